@@ -22,10 +22,18 @@
 #include <usbdlib.h>
 #include <wdf.h>
 #include <wdfusb.h>
+#include <intrin.h>
+#include <nmmintrin.h>
 #include <usbchief.h>
 #include <usbchief.tmh>
 
 static ULONG DebugLevel = 0;//0xffffffff;
+static ULONG Crc32cTable[256];
+static BOOLEAN Crc32cHardware;
+/* sessions are kept by the driver, a removal takes the device context */
+static WDFWAITLOCK SessionLock;
+static SESSION Sessions[SESSION_SLOTS];
+static ULONG SessionNextToken;
 
 #ifdef ALLOC_PRAGMA
 
@@ -38,12 +46,50 @@ static NTSTATUS UsbChief_ReadAndSelectDescriptors(IN WDFDEVICE Device);
 static NTSTATUS UsbChief_ConfigureDevice(IN WDFDEVICE Device);
 static NTSTATUS UsbChief_ResetDevice(IN WDFDEVICE Device);
 static NTSTATUS UsbChief_SelectInterfaces(IN WDFDEVICE Device);
-static WDFUSBPIPE UsbChief_GetPipeFromName(IN PDEVICE_CONTEXT DeviceContext,
-					   IN PUNICODE_STRING FileName);
+static NTSTATUS UsbChief_SelectSetting(IN WDFDEVICE Device, IN UCHAR Setting);
+static VOID UsbChief_DispatchEnter(IN PDEVICE_CONTEXT DeviceContext);
+static VOID UsbChief_DispatchLeave(IN PDEVICE_CONTEXT DeviceContext);
+static NTSTATUS UsbChief_GetDeviceInfo(IN PDEVICE_CONTEXT DeviceContext, IN PUCHAR Buffer,
+				       IN ULONG BufferLength, OUT PULONG Length);
+static PPIPE_CONTEXT UsbChief_GetPipeFromName(IN PDEVICE_CONTEXT DeviceContext,
+					      IN PUNICODE_STRING FileName,
+					      OUT PUCHAR EndpointAddress);
+static VOID UsbChief_ReadAheadQuiesce(IN PREAD_AHEAD ReadAhead);
+static VOID UsbChief_ReadAheadResume(IN PREAD_AHEAD ReadAhead, IN PPIPE_CONTEXT PipeContext);
+static NTSTATUS UsbChief_ReadAheadCreate(IN WDFFILEOBJECT FileObject, IN ULONG PipeMask,
+					 IN PUSBCHIEF_READ_AHEAD_PARAMS Params,
+					 IN PUSBCHIEF_GAP_RECORD Gap);
+static VOID UsbChief_ReadAheadDestroy(IN PREAD_AHEAD ReadAhead);
+static VOID UsbChief_ReadAheadGetStats(IN PREAD_AHEAD ReadAhead,
+				       OUT PUSBCHIEF_READ_AHEAD_STATS Stats);
+static NTSTATUS UsbChief_ReadAheadSetPolicy(IN PREAD_AHEAD ReadAhead, IN ULONG Policy);
+static NTSTATUS UsbChief_AutotuneSet(IN WDFFILEOBJECT FileObject,
+				     IN PUSBCHIEF_AUTOTUNE_PARAMS Params);
+static VOID UsbChief_AutotuneGet(IN PREAD_AHEAD ReadAhead, OUT PUSBCHIEF_AUTOTUNE_STATE State);
+static NTSTATUS UsbChief_FilterSet(IN PREAD_AHEAD ReadAhead, IN PUSBCHIEF_FILTER_RULE Rules,
+				   IN ULONG Count);
+static VOID UsbChief_FilterGetStats(IN PREAD_AHEAD ReadAhead, OUT PUSBCHIEF_FILTER_STATS Stats);
+static NTSTATUS UsbChief_VendorDownload(IN PDEVICE_CONTEXT DeviceContext,
+					IN PUSBCHIEF_DOWNLOAD Download);
+static VOID UsbChief_Trace(IN PDEVICE_CONTEXT DeviceContext, IN UCHAR Type,
+			   IN UCHAR EndpointAddress, IN ULONGLONG StartTime, IN NTSTATUS Status,
+			   IN ULONG Code, IN ULONG Length, IN ULONG Information,
+			   IN PVOID Payload, IN ULONG PayloadLength);
+static NTSTATUS UsbChief_TraceStart(IN WDFDEVICE Device, IN ULONG Records);
+static ULONG UsbChief_TraceGet(IN PDEVICE_CONTEXT DeviceContext,
+			       OUT PUSBCHIEF_TRACE_RECORD Records, IN ULONG Count);
+static NTSTATUS UsbChief_AnalyticsSet(IN WDFDEVICE Device, IN PUSBCHIEF_ANALYTICS_PARAMS Params);
+static NTSTATUS UsbChief_AnalyticsGet(IN PDEVICE_CONTEXT DeviceContext,
+				      OUT PUSBCHIEF_ANALYTICS Snapshot);
+static ULONG UsbChief_SessionGet(IN WDFFILEOBJECT FileObject);
+static NTSTATUS UsbChief_SessionResume(IN WDFFILEOBJECT FileObject, IN ULONG Token);
+static VOID UsbChief_SessionClose(IN PDEVICE_CONTEXT DeviceContext, IN PFILE_CONTEXT FileContext);
 
 static EVT_WDF_DRIVER_DEVICE_ADD UsbChief_EvtDeviceAdd;
 static EVT_WDF_DEVICE_PREPARE_HARDWARE UsbChief_EvtDevicePrepareHardware;
+static EVT_WDF_DEVICE_SURPRISE_REMOVAL UsbChief_EvtDeviceSurpriseRemoval;
 static EVT_WDF_DEVICE_FILE_CREATE UsbChief_EvtDeviceFileCreate;
+static EVT_WDF_FILE_CLEANUP UsbChief_EvtFileCleanup;
 static EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL UsbChief_EvtIoDeviceControl;
 static EVT_WDF_IO_QUEUE_IO_READ UsbChief_EvtIoRead;
 static EVT_WDF_IO_QUEUE_IO_WRITE UsbChief_EvtIoWrite;
@@ -52,6 +98,10 @@ static EVT_WDF_IO_QUEUE_IO_RESUME UsbChief_EvtIoResume;
 static EVT_WDF_DRIVER_DEVICE_ADD UsbChief_EvtDeviceAdd;
 static EVT_WDF_WORKITEM UsbChief_ReadWriteWorkItem;
 static EVT_WDF_REQUEST_COMPLETION_ROUTINE UsbChief_ReadCompletion;
+static EVT_WDF_REQUEST_COMPLETION_ROUTINE UsbChief_ReadAheadCompletion;
+static EVT_WDF_REQUEST_COMPLETION_ROUTINE UsbChief_DownloadCompletion;
+static EVT_WDF_TIMER UsbChief_AutotuneTimer;
+static EVT_WDF_TIMER UsbChief_AnalyticsTimer;
 
 #pragma alloc_text(PAGE, UsbChief_EvtDeviceAdd)
 #pragma alloc_text(PAGE, UsbChief_ConfigureDevice)
@@ -60,6 +110,7 @@ static EVT_WDF_REQUEST_COMPLETION_ROUTINE UsbChief_ReadCompletion;
 #pragma alloc_text(PAGE, UsbChief_SelectInterfaces)
 #pragma alloc_text(PAGE, UsbChief_EvtDevicePrepareHardware)
 #pragma alloc_text(PAGE, UsbChief_EvtDeviceFileCreate)
+#pragma alloc_text(PAGE, UsbChief_EvtFileCleanup)
 #pragma alloc_text(PAGE, UsbChief_EvtIoDeviceControl)
 #pragma alloc_text(PAGE, UsbChief_EvtIoRead)
 #pragma alloc_text(PAGE, UsbChief_EvtIoWrite)
@@ -69,9 +120,67 @@ static EVT_WDF_REQUEST_COMPLETION_ROUTINE UsbChief_ReadCompletion;
 #pragma alloc_text(PAGE, UsbChief_ResetPipe)
 #pragma alloc_text(PAGE, UsbChief_ResetDevice)
 #pragma alloc_text(PAGE, UsbChief_GetPipeFromName)
+#pragma alloc_text(PAGE, UsbChief_VendorDownload)
+#pragma alloc_text(PAGE, UsbChief_SelectSetting)
+#pragma alloc_text(PAGE, UsbChief_SessionGet)
+#pragma alloc_text(PAGE, UsbChief_SessionResume)
+#pragma alloc_text(PAGE, UsbChief_SessionClose)
+#pragma alloc_text(PAGE, UsbChief_EvtDeviceSurpriseRemoval)
 
 #endif
 
+/* cache what the I/O path needs about every pipe of the current setting */
+static VOID UsbChief_BuildPipeTable(IN PDEVICE_CONTEXT DeviceContext)
+{
+	WDF_USB_PIPE_INFORMATION pipeInfo;
+	PPIPE_CONTEXT pipeContext;
+	WDFUSBPIPE pipe;
+	UCHAR count, i;
+
+	count = WdfUsbInterfaceGetNumConfiguredPipes(DeviceContext->UsbInterface);
+	if (count > USBCHIEF_MAX_PIPES)
+		count = USBCHIEF_MAX_PIPES;
+
+	RtlZeroMemory(DeviceContext->Pipes, USBCHIEF_MAX_PIPES * sizeof(PIPE_CONTEXT));
+	RtlZeroMemory(DeviceContext->EndpointMap, sizeof(DeviceContext->EndpointMap));
+	DeviceContext->MaximumTransferSize = 0;
+	DeviceContext->SettingGeneration++;
+
+	for (i = 0; i < count; i++) {
+		pipeContext = &DeviceContext->Pipes[i];
+
+		WDF_USB_PIPE_INFORMATION_INIT(&pipeInfo);
+		pipe = WdfUsbInterfaceGetConfiguredPipe(DeviceContext->UsbInterface, i, &pipeInfo);
+		WdfUsbTargetPipeSetNoMaximumPacketSizeCheck(pipe);
+
+		pipeContext->Pipe = pipe;
+		pipeContext->UsbdPipeHandle = WdfUsbTargetPipeWdmGetPipeHandle(pipe);
+		pipeContext->PipeType = pipeInfo.PipeType;
+		pipeContext->In = WdfUsbTargetPipeIsInEndpoint(pipe);
+		pipeContext->EndpointAddress = pipeInfo.EndpointAddress;
+		pipeContext->Index = i;
+		pipeContext->Interval = pipeInfo.Interval;
+		pipeContext->MaximumPacketSize = pipeInfo.MaximumPacketSize;
+		pipeContext->MaximumTransferSize = pipeInfo.MaximumTransferSize;
+
+		pipeContext->StageSize = MAX_TRANSFER_SIZE;
+		if (pipeInfo.MaximumTransferSize && pipeInfo.MaximumTransferSize < MAX_TRANSFER_SIZE)
+			pipeContext->StageSize = pipeInfo.MaximumTransferSize;
+		if (pipeInfo.MaximumPacketSize && pipeContext->StageSize >= pipeInfo.MaximumPacketSize)
+			pipeContext->StageSize -= pipeContext->StageSize % pipeInfo.MaximumPacketSize;
+
+		if (pipeContext->StageSize > DeviceContext->MaximumTransferSize)
+			DeviceContext->MaximumTransferSize = pipeContext->StageSize;
+
+		DeviceContext->EndpointMap[USBCHIEF_ENDPOINT_SLOT(pipeInfo.EndpointAddress)] = i + 1;
+
+		UsbChief_DbgPrint(DEBUG_CONFIG, ("pipe %d: EP%02X type %d, %d byte packets, %d byte stages\n",
+						 i, pipeInfo.EndpointAddress, pipeInfo.PipeType,
+						 pipeInfo.MaximumPacketSize, pipeContext->StageSize));
+	}
+	DeviceContext->NumberConfiguredPipes = count;
+}
+
 static NTSTATUS UsbChief_SelectInterfaces(IN WDFDEVICE Device)
 {
 	WDF_USB_DEVICE_SELECT_CONFIG_PARAMS configParams;
@@ -94,8 +203,7 @@ static NTSTATUS UsbChief_SelectInterfaces(IN WDFDEVICE Device)
 		pDeviceContext->UsbInterface =
 			configParams.Types.SingleInterface.ConfiguredUsbInterface;
 
-		pDeviceContext->NumberConfiguredPipes =
-			configParams.Types.SingleInterface.NumberConfiguredPipes;
+		UsbChief_BuildPipeTable(pDeviceContext);
 	}
 	return Status;
 
@@ -252,22 +360,60 @@ static NTSTATUS UsbChief_EvtDevicePrepareHardware(IN WDFDEVICE Device,
 	return STATUS_SUCCESS;
 }
 
-static WDFUSBPIPE UsbChief_GetPipeFromName(IN PDEVICE_CONTEXT DeviceContext,
-					   IN PUNICODE_STRING FileName)
+/*
+ * Pipe handles are opened by pipe index in decimal, "\0", "\1", ..., or
+ * by endpoint address in hex, "\EP81", "\EP02", .... Either way the pipe
+ * comes straight out of the pipe table.
+ */
+static PPIPE_CONTEXT UsbChief_GetPipeFromName(IN PDEVICE_CONTEXT DeviceContext,
+					      IN PUNICODE_STRING FileName,
+					      OUT PUCHAR EndpointAddress)
 {
 	LONG ix;
 	ULONG uval;
 	ULONG nameLength;
 	ULONG umultiplier;
-	WDFUSBPIPE pipe = NULL;
+	WCHAR c;
+	UCHAR slot;
+	PPIPE_CONTEXT pipeContext = NULL;
 
 	PAGED_CODE();
 
+	*EndpointAddress = 0;
 	nameLength = (FileName->Length / sizeof(WCHAR));
 
 	if(nameLength != 0) {
 		UsbChief_DbgPrint(DEBUG_RW, ("Filename = %wZ nameLength = %d\n", FileName, nameLength));
 
+		ix = 0;
+		while ((ULONG)ix < nameLength && FileName->Buffer[ix] == (WCHAR) '\\')
+			ix++;
+
+		if (nameLength - ix > 2 &&
+		    (FileName->Buffer[ix] | 0x20) == (WCHAR) 'e' &&
+		    (FileName->Buffer[ix + 1] | 0x20) == (WCHAR) 'p') {
+
+			uval = 0;
+			for (ix += 2; (ULONG)ix < nameLength && uval <= 0xff; ix++) {
+				c = FileName->Buffer[ix];
+				if (c >= (WCHAR) '0' && c <= (WCHAR) '9')
+					uval = uval * 16 + (c - (WCHAR) '0');
+				else if ((c | 0x20) >= (WCHAR) 'a' && (c | 0x20) <= (WCHAR) 'f')
+					uval = uval * 16 + ((c | 0x20) - (WCHAR) 'a' + 10);
+				else
+					break;
+			}
+
+			if ((ULONG)ix == nameLength && !(uval & ~0x8f)) {
+				slot = DeviceContext->EndpointMap[USBCHIEF_ENDPOINT_SLOT(uval)];
+				if (slot) {
+					pipeContext = &DeviceContext->Pipes[slot - 1];
+					*EndpointAddress = (UCHAR)uval;
+				}
+			}
+			goto out;
+		}
+
 		ix = nameLength - 1;
 
 		while((ix > -1) &&
@@ -290,12 +436,13 @@ static WDFUSBPIPE UsbChief_GetPipeFromName(IN PDEVICE_CONTEXT DeviceContext,
 				ix--;
 				umultiplier *= 10;
 			}
-			pipe = WdfUsbInterfaceGetConfiguredPipe(DeviceContext->UsbInterface,
-								(UCHAR)uval, NULL);
+			if (uval < DeviceContext->NumberConfiguredPipes)
+				pipeContext = &DeviceContext->Pipes[uval];
 		}
 	}
+out:
 	UsbChief_DbgPrint(DEBUG_RW, ("GetPipeFromName - ends\n"));
-	return pipe;
+	return pipeContext;
 }
 
 static VOID UsbChief_EvtDeviceFileCreate(IN WDFDEVICE Device, IN WDFREQUEST Request,
@@ -305,7 +452,7 @@ static VOID UsbChief_EvtDeviceFileCreate(IN WDFDEVICE Device, IN WDFREQUEST Requ
 	PUNICODE_STRING fileName;
 	PFILE_CONTEXT pFileContext;
 	PDEVICE_CONTEXT pDevContext;
-	WDFUSBPIPE  pipe;
+	PPIPE_CONTEXT pipeContext;
 
 	PAGED_CODE();
 
@@ -316,15 +463,19 @@ static VOID UsbChief_EvtDeviceFileCreate(IN WDFDEVICE Device, IN WDFREQUEST Requ
 
 	fileName = WdfFileObjectGetFileName(FileObject);
 
+	WdfWaitLockAcquire(pDevContext->OpenFilesLock, NULL);
+
 	if (!fileName->Length) {
 		status = STATUS_SUCCESS;
 	} else {
-		pipe = UsbChief_GetPipeFromName(pDevContext, fileName);
-
-		if (pipe != NULL) {
-			pFileContext->Pipe = pipe;
+		pipeContext = UsbChief_GetPipeFromName(pDevContext, fileName,
+						       &pFileContext->EndpointAddress);
 
-			WdfUsbTargetPipeSetNoMaximumPacketSizeCheck(pipe);
+		if (pipeContext != NULL) {
+			pFileContext->Pipe = pipeContext->Pipe;
+			pFileContext->PipeContext = pipeContext;
+			pFileContext->PipeIndex = pipeContext->Index;
+			pFileContext->PipeHandle = TRUE;
 
 			status = STATUS_SUCCESS;
 		} else {
@@ -332,9 +483,40 @@ static VOID UsbChief_EvtDeviceFileCreate(IN WDFDEVICE Device, IN WDFREQUEST Requ
 		}
 	}
 
+	/* all handles, a root handle may run a capture */
+	if (NT_SUCCESS(status))
+		InsertTailList(&pDevContext->OpenFiles, &pFileContext->Link);
+
+	WdfWaitLockRelease(pDevContext->OpenFilesLock);
+
 	WdfRequestComplete(Request, status);
 }
 
+static VOID UsbChief_EvtFileCleanup(IN WDFFILEOBJECT FileObject)
+{
+	PDEVICE_CONTEXT pDevContext;
+	PFILE_CONTEXT pFileContext;
+
+	PAGED_CODE();
+
+	pDevContext = GetDeviceContext(WdfFileObjectGetDevice(FileObject));
+	pFileContext = GetFileContext(FileObject);
+
+	if (pFileContext->Link.Flink) {
+		WdfWaitLockAcquire(pDevContext->OpenFilesLock, NULL);
+		RemoveEntryList(&pFileContext->Link);
+		WdfWaitLockRelease(pDevContext->OpenFilesLock);
+	}
+
+	if (pFileContext->SessionToken)
+		UsbChief_SessionClose(pDevContext, pFileContext);
+
+	if (pFileContext->ReadAhead) {
+		UsbChief_ReadAheadDestroy(pFileContext->ReadAhead);
+		pFileContext->ReadAhead = NULL;
+	}
+}
+
 static VOID UsbChief_EvtIoDeviceControl(IN WDFQUEUE Queue, IN WDFREQUEST Request,
 				 IN size_t OutputBufferLength, IN size_t InputBufferLength,
 				 IN ULONG IoControlCode)
@@ -346,8 +528,29 @@ static VOID UsbChief_EvtIoDeviceControl(IN WDFQUEUE Queue, IN WDFREQUEST Request
 	UCHAR test[4096];
 	UCHAR *config;
 	WORD *version;
+	DWORD *mode, *timeout, *policy, *traceSize, *token;
+	PUSBCHIEF_TIMESTAMP_BASE timeBase;
+	LARGE_INTEGER frequency, systemTime;
+	PUSBCHIEF_READ_AHEAD_PARAMS readAheadParams;
+	PUSBCHIEF_CAPTURE_PARAMS captureParams;
+	PUSBCHIEF_AUTOTUNE_PARAMS autotuneParams;
+	PUSBCHIEF_AUTOTUNE_STATE autotuneState;
+	PUSBCHIEF_READ_AHEAD_STATS readAheadStats;
+	PUSBCHIEF_DOWNLOAD download;
+	PUSBCHIEF_DOWNLOAD_PROGRESS progress;
+	PUCHAR deviceInfo;
+	ULONG infoLength;
+	PFILE_CONTEXT pFileContext;
+	PUSBCHIEF_TRACE_RECORD traceRecords;
+	PUSBCHIEF_ANALYTICS_PARAMS analyticsParams;
+	PUSBCHIEF_ANALYTICS analytics;
+	PUSBCHIEF_FILTER_RULE filterRules;
+	PUSBCHIEF_FILTER_STATS filterStats;
+	UCHAR tracePayload[TRACE_PAYLOAD_SIZE];
+	ULONG traceLength = 0;
+	ULONGLONG startTime = 0;
+	PVOID input;
 	URB Urb;
-	WDF_USB_INTERFACE_SELECT_SETTING_PARAMS interfaceParams;
 	ULONG i;
 	UNREFERENCED_PARAMETER(OutputBufferLength);
 	UNREFERENCED_PARAMETER(InputBufferLength);
@@ -356,6 +559,16 @@ static VOID UsbChief_EvtIoDeviceControl(IN WDFQUEUE Queue, IN WDFREQUEST Request
 	PAGED_CODE();
 
 	pDeviceContext = GetDeviceContext(WdfIoQueueGetDevice(Queue));
+	UsbChief_DispatchEnter(pDeviceContext);
+
+	/* METHOD_BUFFERED output overwrites the input, keep it for the trace */
+	if (pDeviceContext->Trace.Size)
+		startTime = KeQueryPerformanceCounter(NULL).QuadPart;
+	if (pDeviceContext->Trace.Size && InputBufferLength &&
+	    NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, 0, &input, &Length))) {
+		traceLength = (ULONG)min(Length, TRACE_PAYLOAD_SIZE);
+		RtlCopyMemory(tracePayload, input, traceLength);
+	}
 
 	Length = 0;
 	switch(IoControlCode) {
@@ -477,10 +690,7 @@ static VOID UsbChief_EvtIoDeviceControl(IN WDFQUEUE Queue, IN WDFREQUEST Request
 			goto out;
 		}
 
-		WDF_USB_INTERFACE_SELECT_SETTING_PARAMS_INIT_SETTING (&interfaceParams, *config);
-
-		Status = WdfUsbInterfaceSelectSetting(pDeviceContext->UsbInterface, WDF_NO_OBJECT_ATTRIBUTES,
-						      &interfaceParams);
+		Status = UsbChief_SelectSetting(WdfIoQueueGetDevice(Queue), *config);
 		break;
 
 	case IOCTL_GET_FIRMWARE_VERSION:
@@ -499,352 +709,2963 @@ static VOID UsbChief_EvtIoDeviceControl(IN WDFQUEUE Queue, IN WDFREQUEST Request
 		*version = pDeviceContext->UsbDeviceDescriptor.bcdDevice;
 		break;
 
-	default:
-		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl %08x (Device %x, Method %x) unknown\n",
-				      IoControlCode, DEVICE_TYPE_FROM_CTL_CODE(IoControlCode),
-				      METHOD_FROM_CTL_CODE(IoControlCode)));
-		Status = STATUS_INVALID_DEVICE_REQUEST;
-		break;
-	}
-out:
-	UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: Status %08x, Length %d\n", Status, Length));
-	WdfRequestCompleteWithInformation(Request, Status, Length);
-}
+	case IOCTL_SET_READ_MODE:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*mode), &mode, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-static VOID UsbChief_StopAllPipes(IN PDEVICE_CONTEXT DeviceContext)
-{
-	UCHAR count,i;
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: SET_READ_MODE %x\n", *mode));
 
-	count = DeviceContext->NumberConfiguredPipes;
-	for (i = 0; i < count; i++) {
-		WDFUSBPIPE pipe;
-		pipe = WdfUsbInterfaceGetConfiguredPipe(DeviceContext->UsbInterface,
-							i, NULL);
-		WdfIoTargetStop(WdfUsbTargetPipeGetIoTarget(pipe),
-				WdfIoTargetCancelSentIo);
-	}
-}
+		if (Length != sizeof(*mode) || (*mode & ~READ_MODE_MASK)) {
+			Status = STATUS_INVALID_PARAMETER;
+			goto out;
+		}
 
+		GetFileContext(WdfRequestGetFileObject(Request))->ReadMode = *mode;
+		Length = 0;
+		break;
 
-static VOID UsbChief_StartAllPipes(IN PDEVICE_CONTEXT DeviceContext)
-{
-	NTSTATUS status;
-	UCHAR count,i;
+	case IOCTL_GET_TIMESTAMP_BASE:
+		Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*timeBase), &timeBase, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	count = DeviceContext->NumberConfiguredPipes;
-	for (i = 0; i < count; i++) {
-		WDFUSBPIPE pipe;
-		pipe = WdfUsbInterfaceGetConfiguredPipe(DeviceContext->UsbInterface,
-							i, NULL);
-		status = WdfIoTargetStart(WdfUsbTargetPipeGetIoTarget(pipe));
-		if (!NT_SUCCESS(status)) {
-			UsbChief_DbgPrint(0, ("StartAllPipes - failed pipe #%d\n", i));
-		}
-	}
-}
+		timeBase->Counter = KeQueryPerformanceCounter(&frequency).QuadPart;
+		KeQuerySystemTime(&systemTime);
+		timeBase->Frequency = frequency.QuadPart;
+		timeBase->SystemTime = systemTime.QuadPart;
+		Length = sizeof(*timeBase);
+		break;
 
-static NTSTATUS UsbChief_ResetDevice(IN WDFDEVICE Device)
-{
-	PDEVICE_CONTEXT pDeviceContext;
-	NTSTATUS status;
+	case IOCTL_SET_READ_TIMEOUT:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*timeout), &timeout, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	UsbChief_DbgPrint(0, ("\n"));
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: SET_READ_TIMEOUT %d\n", *timeout));
 
-	PAGED_CODE();
+		GetFileContext(WdfRequestGetFileObject(Request))->ReadTimeout = *timeout;
+		Length = 0;
+		break;
 
-	pDeviceContext = GetDeviceContext(Device);
+	case IOCTL_SET_READ_AHEAD:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*readAheadParams),
+						       &readAheadParams, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	UsbChief_StopAllPipes(pDeviceContext);
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: SET_READ_AHEAD %d/%d/%d\n",
+				      readAheadParams->Size, readAheadParams->StageSize,
+				      readAheadParams->Depth));
 
-	status = WdfUsbTargetDeviceIsConnectedSynchronous(pDeviceContext->WdfUsbTargetDevice);
+		Status = UsbChief_ReadAheadCreate(WdfRequestGetFileObject(Request), 0,
+						  readAheadParams, NULL);
+		Length = 0;
+		break;
 
-	if(NT_SUCCESS(status)) {
-		status = WdfUsbTargetDeviceResetPortSynchronously(pDeviceContext->WdfUsbTargetDevice);
-	}
+	case IOCTL_START_CAPTURE:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*captureParams),
+						       &captureParams, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	UsbChief_StartAllPipes(pDeviceContext);
-	return status;
-}
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: START_CAPTURE %08x %d/%d/%d\n",
+				      captureParams->PipeMask, captureParams->ReadAhead.Size,
+				      captureParams->ReadAhead.StageSize, captureParams->ReadAhead.Depth));
 
-static NTSTATUS UsbChief_ResetPipe(IN WDFUSBPIPE Pipe)
-{
-	NTSTATUS status;
+		if (!captureParams->PipeMask) {
+			Status = STATUS_INVALID_PARAMETER;
+			Length = 0;
+			goto out;
+		}
 
-	PAGED_CODE();
+		Status = UsbChief_ReadAheadCreate(WdfRequestGetFileObject(Request),
+						  captureParams->PipeMask, &captureParams->ReadAhead,
+						  NULL);
+		Length = 0;
+		break;
 
-	status = WdfUsbTargetPipeResetSynchronously(Pipe, WDF_NO_HANDLE, NULL);
+	case IOCTL_GET_READ_AHEAD_STATS:
+		Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*readAheadStats),
+							&readAheadStats, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	if (NT_SUCCESS(status)) {
-		UsbChief_DbgPrint(DEBUG_CONFIG, ("success\n"));
-		status = STATUS_SUCCESS;
-	}
-	else {
-		UsbChief_DbgPrint(0, ("failed\n"));
-	}
-	return status;
-}
+		pFileContext = GetFileContext(WdfRequestGetFileObject(Request));
+		if (!pFileContext->ReadAhead) {
+			Status = STATUS_INVALID_DEVICE_REQUEST;
+			Length = 0;
+			goto out;
+		}
 
-static VOID UsbChief_ReadWriteWorkItem(IN WDFWORKITEM  WorkItem)
-{
-	PWORKITEM_CONTEXT pItemContext;
-	NTSTATUS status;
+		UsbChief_ReadAheadGetStats(pFileContext->ReadAhead, readAheadStats);
+		Length = sizeof(*readAheadStats);
+		break;
 
-	UsbChief_DbgPrint(DEBUG_RW, ("called\n"));
+	case IOCTL_SET_OVERFLOW_POLICY:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*policy), &policy, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	pItemContext = GetWorkItemContext(WorkItem);
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: SET_OVERFLOW_POLICY %d\n", *policy));
 
-	status = UsbChief_ResetPipe(pItemContext->Pipe);
-	if (!NT_SUCCESS(status)) {
-		status = UsbChief_ResetDevice(pItemContext->Device);
-		if(!NT_SUCCESS(status))
-			UsbChief_DbgPrint(0, ("ResetDevice failed 0x%x\n", status));
-	}
-	WdfObjectDelete(WorkItem);
-}
+		pFileContext = GetFileContext(WdfRequestGetFileObject(Request));
+		Length = 0;
+		if (!pFileContext->ReadAhead) {
+			Status = STATUS_INVALID_DEVICE_REQUEST;
+			goto out;
+		}
 
-static NTSTATUS UsbChief_QueuePassiveLevelCallback(IN WDFDEVICE    Device,
-				   IN WDFUSBPIPE   Pipe)
-{
-	NTSTATUS                       status = STATUS_SUCCESS;
-	PWORKITEM_CONTEXT               context;
-	WDF_OBJECT_ATTRIBUTES           attributes;
-	WDF_WORKITEM_CONFIG             workitemConfig;
-	WDFWORKITEM                     hWorkItem;
+		Status = UsbChief_ReadAheadSetPolicy(pFileContext->ReadAhead, *policy);
+		break;
 
-	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
-	WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(&attributes, WORKITEM_CONTEXT);
-	attributes.ParentObject = Device;
+	case IOCTL_SET_AUTOTUNE:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*autotuneParams),
+						       &autotuneParams, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	WDF_WORKITEM_CONFIG_INIT(&workitemConfig, UsbChief_ReadWriteWorkItem);
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: SET_AUTOTUNE %d, stage %d-%d, depth %d-%d, %d ms, %d us\n",
+				      autotuneParams->Enable, autotuneParams->MinStageSize,
+				      autotuneParams->MaxStageSize, autotuneParams->MinDepth,
+				      autotuneParams->MaxDepth, autotuneParams->Interval,
+				      autotuneParams->LatencyTarget));
 
-	status = WdfWorkItemCreate( &workitemConfig,
-				    &attributes,
-				    &hWorkItem);
+		Status = UsbChief_AutotuneSet(WdfRequestGetFileObject(Request), autotuneParams);
+		Length = 0;
+		break;
 
-	if (!NT_SUCCESS(status))
-		return status;
+	case IOCTL_GET_AUTOTUNE:
+		Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*autotuneState),
+							&autotuneState, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	context = GetWorkItemContext(hWorkItem);
+		pFileContext = GetFileContext(WdfRequestGetFileObject(Request));
+		if (!pFileContext->ReadAhead) {
+			Status = STATUS_INVALID_DEVICE_REQUEST;
+			Length = 0;
+			goto out;
+		}
 
-	context->Device = Device;
-	context->Pipe = Pipe;
+		UsbChief_AutotuneGet(pFileContext->ReadAhead, autotuneState);
+		Length = sizeof(*autotuneState);
+		break;
 
-	WdfWorkItemEnqueue(hWorkItem);
-	return STATUS_SUCCESS;
-}
+	case IOCTL_SET_TRACE:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*traceSize), &traceSize, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: SET_TRACE %d records\n", *traceSize));
 
-static VOID UsbChief_ReadCompletion(IN WDFREQUEST Request, IN WDFIOTARGET Target,
-			     PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
-			     IN WDFCONTEXT Context)
-{
-	PMDL requestMdl;
-	WDFUSBPIPE pipe;
-	ULONG stageLength;
-	NTSTATUS status;
-	PREQUEST_CONTEXT rwContext;
-	PURB urb;
-	ULONG bytesRead;
+		Status = UsbChief_TraceStart(WdfIoQueueGetDevice(Queue), *traceSize);
+		Length = 0;
+		break;
 
-	UNREFERENCED_PARAMETER(Context);
-	rwContext = GetRequestContext(Request);
+	case IOCTL_GET_TRACE:
+		Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*traceRecords),
+							&traceRecords, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	pipe = (WDFUSBPIPE)Target;
-	status = CompletionParams->IoStatus.Status;
+		Length = UsbChief_TraceGet(pDeviceContext, traceRecords,
+					   (ULONG)(Length / sizeof(*traceRecords))) * sizeof(*traceRecords);
+		break;
 
-	if (!NT_SUCCESS(status)){
-		UsbChief_QueuePassiveLevelCallback(WdfIoTargetGetDevice(Target), pipe);
-		goto End;
-	}
+	case IOCTL_SET_FILTER:
+		filterRules = NULL;
+		if (InputBufferLength) {
+			Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*filterRules),
+							       &filterRules, &Length);
+			if (!NT_SUCCESS(Status))
+				goto out;
+		}
 
-	urb = (PURB) WdfMemoryGetBuffer(rwContext->UrbMemory, NULL);
-	bytesRead = urb->UrbBulkOrInterruptTransfer.TransferBufferLength;
-	rwContext->Numxfer += bytesRead;
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: SET_FILTER %d rules\n",
+				      InputBufferLength / sizeof(*filterRules)));
 
-	if (rwContext->Length == 0) {
-		WdfRequestSetInformation(Request, rwContext->Numxfer);
-		goto End;
-	}
+		pFileContext = GetFileContext(WdfRequestGetFileObject(Request));
+		Length = 0;
+		if (!pFileContext->ReadAhead || InputBufferLength % sizeof(*filterRules)) {
+			Status = STATUS_INVALID_DEVICE_REQUEST;
+			goto out;
+		}
 
-	if (rwContext->Length > MAX_TRANSFER_SIZE)
-		stageLength = MAX_TRANSFER_SIZE;
-	else
-		stageLength = rwContext->Length;
+		Status = UsbChief_FilterSet(pFileContext->ReadAhead, filterRules,
+					    (ULONG)(InputBufferLength / sizeof(*filterRules)));
+		break;
 
-	UsbChief_DbgPrint(DEBUG_RW, ("Stage next Read transfer... %d bytes remaing\n", rwContext->Length));
-	MmPrepareMdlForReuse(rwContext->Mdl);
+	case IOCTL_GET_FILTER_STATS:
+		Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*filterStats),
+							&filterStats, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	status = WdfRequestRetrieveOutputWdmMdl(Request, &requestMdl);
-	if(!NT_SUCCESS(status)){
-		UsbChief_DbgPrint(0, ("WdfRequestRetrieveOutputWdmMdl for Read failed %x\n", status));
-		goto End;
-	}
+		pFileContext = GetFileContext(WdfRequestGetFileObject(Request));
+		if (!pFileContext->ReadAhead) {
+			Status = STATUS_INVALID_DEVICE_REQUEST;
+			Length = 0;
+			goto out;
+		}
 
-	IoBuildPartialMdl(requestMdl, rwContext->Mdl,
-			  (PVOID) rwContext->VirtualAddress, stageLength);
+		UsbChief_FilterGetStats(pFileContext->ReadAhead, filterStats);
+		Length = sizeof(*filterStats);
+		break;
 
-	urb->UrbBulkOrInterruptTransfer.TransferBufferLength = stageLength;
+	case IOCTL_SET_ANALYTICS:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*analyticsParams),
+						       &analyticsParams, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	rwContext->VirtualAddress += stageLength;
-	rwContext->Length -= stageLength;
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: SET_ANALYTICS %d ms x %d\n",
+				      analyticsParams->Interval, analyticsParams->Windows));
 
-	status = WdfUsbTargetPipeFormatRequestForUrb(pipe, Request,
-						     rwContext->UrbMemory, NULL);
-	if (!NT_SUCCESS(status)) {
-		UsbChief_DbgPrint(0, ("Failed to format requset for urb\n"));
-		status = STATUS_INSUFFICIENT_RESOURCES;
-		goto End;
-	}
+		Status = UsbChief_AnalyticsSet(WdfIoQueueGetDevice(Queue), analyticsParams);
+		Length = 0;
+		break;
 
-	WdfRequestSetCompletionRoutine(Request, UsbChief_ReadCompletion, NULL);
+	case IOCTL_GET_ANALYTICS:
+		Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*analytics), &analytics, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	if (!WdfRequestSend(Request, WdfUsbTargetPipeGetIoTarget(pipe), WDF_NO_SEND_OPTIONS)) {
-		UsbChief_DbgPrint(0, ("WdfRequestSend for Read failed\n"));
-		status = WdfRequestGetStatus(Request);
-		goto End;
-	}
-	return;
+		Status = UsbChief_AnalyticsGet(pDeviceContext, analytics);
+		Length = NT_SUCCESS(Status) ? sizeof(*analytics) : 0;
+		break;
 
-End:
-	IoFreeMdl(rwContext->Mdl);
+	case IOCTL_GET_SESSION:
+		Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*token), &token, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
 
-	UsbChief_DbgPrint(DEBUG_RW, ("Read request completed with status 0x%x\n", status));
-	WdfRequestComplete(Request, status);
-}
+		*token = UsbChief_SessionGet(WdfRequestGetFileObject(Request));
+		if (!*token) {
+			Status = STATUS_INSUFFICIENT_RESOURCES;
+			Length = 0;
+			goto out;
+		}
+		Length = sizeof(*token);
+		break;
 
-static VOID UsbChief_ReadEndPoint(IN WDFQUEUE Queue, IN WDFREQUEST Request,
+	case IOCTL_RESUME_SESSION:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*token), &token, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
+
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: RESUME_SESSION %d\n", *token));
+
+		Status = UsbChief_SessionResume(WdfRequestGetFileObject(Request), *token);
+		Length = 0;
+		break;
+
+	case IOCTL_VENDOR_DOWNLOAD:
+		Status = WdfRequestRetrieveInputBuffer(Request, sizeof(*download), &download, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
+
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: VENDOR_DOWNLOAD %x, Address %x, Index %x, Chunk %d, Length %d\n",
+				      download->Request, download->Address, download->Index,
+				      download->ChunkSize, download->Length));
+
+		if (Length - sizeof(*download) != download->Length || !download->Length ||
+		    !download->ChunkSize || download->Address + download->Length - 1 > 0xffff) {
+			Status = STATUS_INVALID_PARAMETER;
+			Length = 0;
+			goto out;
+		}
+
+		/* no output, progress is only told by IOCTL_GET_DOWNLOAD_PROGRESS */
+		Status = UsbChief_VendorDownload(pDeviceContext, download);
+		Length = 0;
+		break;
+
+	case IOCTL_GET_DOWNLOAD_PROGRESS:
+		Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*progress), &progress, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
+
+		progress->Done = pDeviceContext->DownloadDone;
+		progress->Total = pDeviceContext->DownloadTotal;
+		Length = sizeof(*progress);
+		break;
+
+	case IOCTL_GET_DEVICE_INFO:
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: GET_DEVICE_INFO\n"));
+
+		Status = WdfRequestRetrieveOutputBuffer(Request, sizeof(USBCHIEF_DEVICE_INFO),
+							&deviceInfo, &Length);
+		if (!NT_SUCCESS(Status))
+			goto out;
+
+		Status = UsbChief_GetDeviceInfo(pDeviceContext, deviceInfo, (ULONG)Length, &infoLength);
+		Length = infoLength;
+		break;
+
+	default:
+		UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl %08x (Device %x, Method %x) unknown\n",
+				      IoControlCode, DEVICE_TYPE_FROM_CTL_CODE(IoControlCode),
+				      METHOD_FROM_CTL_CODE(IoControlCode)));
+		Status = STATUS_INVALID_DEVICE_REQUEST;
+		break;
+	}
+out:
+	UsbChief_DbgPrint(DEBUG_IOCTL, ("EvtDeviceControl: Status %08x, Length %d\n", Status, Length));
+	if (IoControlCode != IOCTL_GET_TRACE)
+		UsbChief_Trace(pDeviceContext, TRACE_IOCTL, 0, startTime, Status, IoControlCode,
+			       (ULONG)InputBufferLength, (ULONG)Length, tracePayload, traceLength);
+	UsbChief_DispatchLeave(pDeviceContext);
+	WdfRequestCompleteWithInformation(Request, Status, Length);
+}
+
+/*
+ * Fill in an IOCTL_GET_DEVICE_INFO blob from what PrepareHardware and the
+ * last setting switch left in the device context; no USB traffic is done.
+ * BufferLength is at least the header size.
+ */
+static NTSTATUS UsbChief_GetDeviceInfo(IN PDEVICE_CONTEXT DeviceContext, IN PUCHAR Buffer,
+				       IN ULONG BufferLength, OUT PULONG Length)
+{
+	PUSBCHIEF_DEVICE_INFO info = (PUSBCHIEF_DEVICE_INFO)Buffer;
+	PUSBCHIEF_PIPE_INFO pipes;
+	PPIPE_CONTEXT pipeContext;
+	NTSTATUS status = STATUS_SUCCESS;
+	ULONG configLength = 0;
+	UCHAR i;
+
+	RtlZeroMemory(info, sizeof(*info));
+
+	/* the pipe table as a setting switch leaves it, see UsbChief_SelectSetting */
+	WdfWaitLockAcquire(DeviceContext->OpenFilesLock, NULL);
+
+	if (DeviceContext->UsbConfigurationDescriptor)
+		configLength = DeviceContext->UsbConfigurationDescriptor->wTotalLength;
+
+	info->Version = USBCHIEF_DEVICE_INFO_VERSION;
+	info->FirmwareVersion = DeviceContext->UsbDeviceDescriptor.bcdDevice;
+	info->HighSpeed = DeviceContext->IsDeviceHighSpeed;
+	info->WaitWake = DeviceContext->WaitWakeEnable != 0;
+	info->MaximumTransferSize = DeviceContext->MaximumTransferSize;
+
+	info->DeviceDescriptorOffset = sizeof(*info);
+	info->DeviceDescriptorLength = sizeof(USB_DEVICE_DESCRIPTOR);
+	info->ConfigurationDescriptorOffset = info->DeviceDescriptorOffset + info->DeviceDescriptorLength;
+	info->ConfigurationDescriptorLength = configLength;
+	info->PipesOffset = USBCHIEF_FRAME_ALIGN_UP(info->ConfigurationDescriptorOffset + configLength);
+	info->PipeInfoLength = sizeof(USBCHIEF_PIPE_INFO);
+
+	if (DeviceContext->UsbInterface) {
+		info->AlternateSetting = WdfUsbInterfaceGetConfiguredSettingIndex(DeviceContext->UsbInterface);
+		info->NumberOfPipes = DeviceContext->NumberConfiguredPipes;
+	}
+
+	info->Length = info->PipesOffset + info->NumberOfPipes * info->PipeInfoLength;
+
+	if (BufferLength < info->Length) {
+		*Length = sizeof(*info);
+		status = STATUS_BUFFER_OVERFLOW;
+		goto out;
+	}
+
+	RtlZeroMemory(Buffer + sizeof(*info), info->Length - sizeof(*info));
+	RtlCopyMemory(Buffer + info->DeviceDescriptorOffset, &DeviceContext->UsbDeviceDescriptor,
+		      info->DeviceDescriptorLength);
+	if (configLength)
+		RtlCopyMemory(Buffer + info->ConfigurationDescriptorOffset,
+			      DeviceContext->UsbConfigurationDescriptor, configLength);
+
+	pipes = (PUSBCHIEF_PIPE_INFO)(Buffer + info->PipesOffset);
+	for (i = 0; i < info->NumberOfPipes; i++) {
+		pipeContext = &DeviceContext->Pipes[i];
+
+		pipes[i].EndpointAddress = pipeContext->EndpointAddress;
+		pipes[i].PipeType = (BYTE)pipeContext->PipeType;
+		pipes[i].Interval = pipeContext->Interval;
+		pipes[i].MaximumPacketSize = pipeContext->MaximumPacketSize;
+		pipes[i].MaximumTransferSize = pipeContext->MaximumTransferSize;
+	}
+
+	*Length = info->Length;
+out:
+	WdfWaitLockRelease(DeviceContext->OpenFilesLock);
+	return status;
+}
+
+static VOID UsbChief_DownloadCompletion(IN WDFREQUEST Request, IN WDFIOTARGET Target,
+					PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+					IN WDFCONTEXT Context)
+{
+	PDOWNLOAD_SLOT slot = (PDOWNLOAD_SLOT)Context;
+
+	UNREFERENCED_PARAMETER(Request);
+	UNREFERENCED_PARAMETER(Target);
+
+	slot->Status = CompletionParams->IoStatus.Status;
+	KeSetEvent(&slot->Done, IO_NO_INCREMENT, FALSE);
+}
+
+static NTSTATUS UsbChief_DownloadCreateSlots(IN PDEVICE_CONTEXT DeviceContext)
+{
+	WDF_OBJECT_ATTRIBUTES attributes;
+	PDOWNLOAD_SLOT slot;
+	NTSTATUS status;
+	ULONG i;
+
+	for (i = 0; i < DOWNLOAD_SLOTS; i++) {
+		slot = &DeviceContext->DownloadSlots[i];
+		if (slot->Request)
+			continue;
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = DeviceContext->WdfUsbTargetDevice;
+
+		status = WdfRequestCreate(&attributes,
+					  WdfUsbTargetDeviceGetIoTarget(DeviceContext->WdfUsbTargetDevice),
+					  &slot->Request);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		attributes.ParentObject = slot->Request;
+
+		status = WdfMemoryCreate(&attributes, NonPagedPool, POOL_TAG,
+					 sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST),
+					 &slot->UrbMemory, (PVOID *)&slot->Urb);
+		if (!NT_SUCCESS(status)) {
+			WdfObjectDelete(slot->Request);
+			slot->Request = NULL;
+			return status;
+		}
+		KeInitializeEvent(&slot->Done, NotificationEvent, FALSE);
+	}
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS UsbChief_DownloadPost(IN PDEVICE_CONTEXT DeviceContext, IN PDOWNLOAD_SLOT Slot,
+				      IN PUSBCHIEF_DOWNLOAD Download, IN PUCHAR Buffer,
+				      IN ULONG Length, IN WORD Value)
+{
+	WDF_REQUEST_REUSE_PARAMS reuseParams;
+	WDF_REQUEST_SEND_OPTIONS options;
+	NTSTATUS status;
+
+	WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+	WdfRequestReuse(Slot->Request, &reuseParams);
+
+	memset(Slot->Urb, 0, sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST));
+	Slot->Urb->UrbHeader.Function = URB_FUNCTION_VENDOR_DEVICE;
+	Slot->Urb->UrbHeader.Length = sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST);
+	Slot->Urb->UrbControlVendorClassRequest.RequestTypeReservedBits = 0x40;
+	Slot->Urb->UrbControlVendorClassRequest.TransferBufferLength = Length;
+	Slot->Urb->UrbControlVendorClassRequest.TransferBuffer = Buffer;
+	Slot->Urb->UrbControlVendorClassRequest.Request = Download->Request;
+	Slot->Urb->UrbControlVendorClassRequest.Value = Value;
+	Slot->Urb->UrbControlVendorClassRequest.Index = Download->Index;
+
+	status = WdfUsbTargetDeviceFormatRequestForUrb(DeviceContext->WdfUsbTargetDevice,
+						       Slot->Request, Slot->UrbMemory, NULL);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	WdfRequestSetCompletionRoutine(Slot->Request, UsbChief_DownloadCompletion, Slot);
+	KeClearEvent(&Slot->Done);
+	Slot->Length = Length;
+
+	/* a stalled transfer is cancelled, so the wait for the slot always ends */
+	WDF_REQUEST_SEND_OPTIONS_INIT(&options, 0);
+	WDF_REQUEST_SEND_OPTIONS_SET_TIMEOUT(&options, WDF_REL_TIMEOUT_IN_MS(DOWNLOAD_TIMEOUT));
+
+	if (!WdfRequestSend(Slot->Request,
+			    WdfUsbTargetDeviceGetIoTarget(DeviceContext->WdfUsbTargetDevice),
+			    &options))
+		return WdfRequestGetStatus(Slot->Request);
+
+	Slot->Busy = TRUE;
+	return STATUS_SUCCESS;
+}
+
+static NTSTATUS UsbChief_DownloadVerify(IN PDEVICE_CONTEXT DeviceContext,
+					IN PUSBCHIEF_DOWNLOAD Download, IN PUCHAR Image)
+{
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_REQUEST_SEND_OPTIONS options;
+	WDFMEMORY memory;
+	PUCHAR buffer;
+	NTSTATUS status;
+	ULONG offset, chunk;
+	URB Urb;
+
+	WDF_REQUEST_SEND_OPTIONS_INIT(&options, 0);
+	WDF_REQUEST_SEND_OPTIONS_SET_TIMEOUT(&options, WDF_REL_TIMEOUT_IN_MS(DOWNLOAD_TIMEOUT));
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = DeviceContext->WdfUsbTargetDevice;
+
+	status = WdfMemoryCreate(&attributes, NonPagedPool, POOL_TAG, Download->ChunkSize,
+				 &memory, (PVOID *)&buffer);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	for (offset = 0; offset < Download->Length; offset += chunk) {
+		chunk = min(Download->ChunkSize, Download->Length - offset);
+
+		memset(&Urb, 0, sizeof(Urb));
+		Urb.UrbHeader.Function = URB_FUNCTION_VENDOR_DEVICE;
+		Urb.UrbHeader.Length = sizeof(struct _URB_CONTROL_VENDOR_OR_CLASS_REQUEST);
+		Urb.UrbControlVendorClassRequest.RequestTypeReservedBits = 0xc0;
+		Urb.UrbControlVendorClassRequest.TransferFlags = USBD_TRANSFER_DIRECTION_IN | USBD_SHORT_TRANSFER_OK;
+		Urb.UrbControlVendorClassRequest.TransferBufferLength = chunk;
+		Urb.UrbControlVendorClassRequest.TransferBuffer = buffer;
+		Urb.UrbControlVendorClassRequest.Request = Download->Request;
+		Urb.UrbControlVendorClassRequest.Value = (WORD)(Download->Address + offset);
+		Urb.UrbControlVendorClassRequest.Index = Download->Index;
+
+		status = WdfUsbTargetDeviceSendUrbSynchronously(DeviceContext->WdfUsbTargetDevice,
+								NULL, &options, &Urb);
+		if (!NT_SUCCESS(status))
+			break;
+
+		if (Urb.UrbControlVendorClassRequest.TransferBufferLength != chunk ||
+		    RtlCompareMemory(buffer, Image + offset, chunk) != chunk) {
+			UsbChief_DbgPrint(0, ("Download verify failed at %x\n", Download->Address + offset));
+			status = STATUS_DATA_ERROR;
+			break;
+		}
+	}
+
+	WdfObjectDelete(memory);
+	return status;
+}
+
+/*
+ * Send the image behind Download as vendor requests, keeping up to
+ * DOWNLOAD_SLOTS of them queued on the default pipe. Slots are reused
+ * round robin, so waiting for the next slot always waits for the oldest
+ * transfer. The first error stops posting; transfers already queued are
+ * still waited for. Every transfer is sent with DOWNLOAD_TIMEOUT, so a
+ * stalled one fails the download with STATUS_IO_TIMEOUT.
+ */
+static NTSTATUS UsbChief_VendorDownload(IN PDEVICE_CONTEXT DeviceContext,
+					IN PUSBCHIEF_DOWNLOAD Download)
+{
+	PDOWNLOAD_SLOT slot;
+	PUCHAR image;
+	NTSTATUS status;
+	ULONG offset, chunk, inflight, n;
+
+	PAGED_CODE();
+
+	image = (PUCHAR)(Download + 1);
+
+	WdfWaitLockAcquire(DeviceContext->DownloadLock, NULL);
+
+	status = UsbChief_DownloadCreateSlots(DeviceContext);
+	if (!NT_SUCCESS(status))
+		goto out;
+
+	InterlockedExchange(&DeviceContext->DownloadDone, 0);
+	InterlockedExchange(&DeviceContext->DownloadTotal, Download->Length);
+
+	offset = 0;
+	inflight = 0;
+
+	for (n = 0; ; n++) {
+		slot = &DeviceContext->DownloadSlots[n % DOWNLOAD_SLOTS];
+
+		if (slot->Busy) {
+			KeWaitForSingleObject(&slot->Done, Executive, KernelMode, FALSE, NULL);
+			slot->Busy = FALSE;
+			inflight--;
+
+			if (!NT_SUCCESS(slot->Status)) {
+				UsbChief_DbgPrint(0, ("Download transfer failed %x\n", slot->Status));
+				if (NT_SUCCESS(status))
+					status = slot->Status;
+			} else {
+				InterlockedExchangeAdd(&DeviceContext->DownloadDone, slot->Length);
+			}
+		}
+
+		if (offset >= Download->Length || !NT_SUCCESS(status)) {
+			if (!inflight)
+				break;
+			continue;
+		}
+
+		chunk = min(Download->ChunkSize, Download->Length - offset);
+		status = UsbChief_DownloadPost(DeviceContext, slot, Download, image + offset,
+					       chunk, (WORD)(Download->Address + offset));
+		if (NT_SUCCESS(status)) {
+			inflight++;
+			offset += chunk;
+		}
+	}
+
+	if (NT_SUCCESS(status) && (Download->Flags & DOWNLOAD_VERIFY))
+		status = UsbChief_DownloadVerify(DeviceContext, Download, image);
+out:
+	WdfWaitLockRelease(DeviceContext->DownloadLock);
+	return status;
+}
+
+static VOID UsbChief_StopAllPipes(IN PDEVICE_CONTEXT DeviceContext)
+{
+	UCHAR count,i;
+
+	count = DeviceContext->NumberConfiguredPipes;
+	for (i = 0; i < count; i++) {
+		WdfIoTargetStop(WdfUsbTargetPipeGetIoTarget(DeviceContext->Pipes[i].Pipe),
+				WdfIoTargetCancelSentIo);
+	}
+}
+
+
+static VOID UsbChief_StartAllPipes(IN PDEVICE_CONTEXT DeviceContext)
+{
+	NTSTATUS status;
+	UCHAR count,i;
+
+	count = DeviceContext->NumberConfiguredPipes;
+	for (i = 0; i < count; i++) {
+		status = WdfIoTargetStart(WdfUsbTargetPipeGetIoTarget(DeviceContext->Pipes[i].Pipe));
+		if (!NT_SUCCESS(status)) {
+			UsbChief_DbgPrint(0, ("StartAllPipes - failed pipe #%d\n", i));
+		}
+	}
+}
+
+/*
+ * Point an open pipe handle at its pipe in the current alternate setting:
+ * the pipe with the same index, or with the same endpoint address if it
+ * was opened by address. A read-ahead handle needs an IN pipe; if the new
+ * setting has none there the handle is left without a pipe.
+ */
+static VOID UsbChief_RebindFile(IN PDEVICE_CONTEXT DeviceContext, IN PFILE_CONTEXT FileContext)
+{
+	PPIPE_CONTEXT pipeContext = NULL;
+	UCHAR slot;
+
+	if (!FileContext->PipeHandle) {
+		/* a root handle only has a capture to move along */
+		if (FileContext->ReadAhead)
+			UsbChief_ReadAheadResume(FileContext->ReadAhead, NULL);
+		return;
+	}
+
+	if (FileContext->EndpointAddress) {
+		slot = DeviceContext->EndpointMap[USBCHIEF_ENDPOINT_SLOT(FileContext->EndpointAddress)];
+		if (slot)
+			pipeContext = &DeviceContext->Pipes[slot - 1];
+	} else if (FileContext->PipeIndex < DeviceContext->NumberConfiguredPipes) {
+		pipeContext = &DeviceContext->Pipes[FileContext->PipeIndex];
+	}
+
+	if (FileContext->ReadAhead && pipeContext && !pipeContext->In)
+		pipeContext = NULL;
+
+	FileContext->PipeContext = pipeContext;
+	FileContext->Pipe = pipeContext ? pipeContext->Pipe : NULL;
+
+	if (FileContext->ReadAhead)
+		UsbChief_ReadAheadResume(FileContext->ReadAhead, pipeContext);
+}
+
+/*
+ * Dispatch routines and the reset work item that look up pipes run between
+ * UsbChief_DispatchEnter and UsbChief_DispatchLeave, so a setting switch
+ * can wait until none of them holds a pipe it is about to delete.
+ */
+static VOID UsbChief_DispatchEnter(IN PDEVICE_CONTEXT DeviceContext)
+{
+	InterlockedIncrement(&DeviceContext->Dispatching);
+}
+
+static VOID UsbChief_DispatchLeave(IN PDEVICE_CONTEXT DeviceContext)
+{
+	if (!InterlockedDecrement(&DeviceContext->Dispatching))
+		KeSetEvent(&DeviceContext->DispatchIdle, IO_NO_INCREMENT, FALSE);
+}
+
+/*
+ * Switch the interface to another alternate setting without closing open
+ * handles: new requests are held in the default queue, requests already
+ * dispatched are waited for, read-ahead rings stop posting and whatever is
+ * still on the pipes is cancelled. Afterwards every open pipe handle is
+ * rebound by index, also when the switch failed and the old setting is
+ * still in place. Called from a dispatch routine.
+ */
+static NTSTATUS UsbChief_SelectSetting(IN WDFDEVICE Device, IN UCHAR Setting)
+{
+	WDF_USB_INTERFACE_SELECT_SETTING_PARAMS interfaceParams;
+	PDEVICE_CONTEXT pDeviceContext;
+	PFILE_CONTEXT pFileContext;
+	LARGE_INTEGER timeout;
+	PLIST_ENTRY entry;
+	WDFQUEUE queue;
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	pDeviceContext = GetDeviceContext(Device);
+	queue = WdfDeviceGetDefaultQueue(Device);
+
+	/* not counted while waiting, or two switches would wait for each other */
+	UsbChief_DispatchLeave(pDeviceContext);
+	WdfWaitLockAcquire(pDeviceContext->SettingLock, NULL);
+
+	/* not synchronously, this request is still running on the queue */
+	WdfIoQueueStop(queue, NULL, NULL);
+
+	timeout.QuadPart = WDF_REL_TIMEOUT_IN_MS(10);
+	for (;;) {
+		KeClearEvent(&pDeviceContext->DispatchIdle);
+		if (!InterlockedCompareExchange(&pDeviceContext->Dispatching, 0, 0))
+			break;
+		KeWaitForSingleObject(&pDeviceContext->DispatchIdle, Executive, KernelMode,
+				      FALSE, &timeout);
+	}
+
+	WdfWaitLockAcquire(pDeviceContext->OpenFilesLock, NULL);
+
+	for (entry = pDeviceContext->OpenFiles.Flink; entry != &pDeviceContext->OpenFiles;
+	     entry = entry->Flink) {
+		pFileContext = CONTAINING_RECORD(entry, FILE_CONTEXT, Link);
+		if (pFileContext->ReadAhead)
+			UsbChief_ReadAheadQuiesce(pFileContext->ReadAhead);
+	}
+
+	UsbChief_StopAllPipes(pDeviceContext);
+
+	WDF_USB_INTERFACE_SELECT_SETTING_PARAMS_INIT_SETTING(&interfaceParams, Setting);
+
+	status = WdfUsbInterfaceSelectSetting(pDeviceContext->UsbInterface, WDF_NO_OBJECT_ATTRIBUTES,
+					      &interfaceParams);
+	if (!NT_SUCCESS(status))
+		UsbChief_DbgPrint(0, ("SelectSetting %d failed %x\n", Setting, status));
+
+	UsbChief_BuildPipeTable(pDeviceContext);
+
+	UsbChief_StartAllPipes(pDeviceContext);
+
+	for (entry = pDeviceContext->OpenFiles.Flink; entry != &pDeviceContext->OpenFiles;
+	     entry = entry->Flink)
+		UsbChief_RebindFile(pDeviceContext, CONTAINING_RECORD(entry, FILE_CONTEXT, Link));
+
+	WdfWaitLockRelease(pDeviceContext->OpenFilesLock);
+	WdfIoQueueStart(queue);
+
+	WdfWaitLockRelease(pDeviceContext->SettingLock);
+	UsbChief_DispatchEnter(pDeviceContext);
+
+	UsbChief_DbgPrint(DEBUG_CONFIG, ("SelectSetting %d: %d pipes\n", Setting,
+					 pDeviceContext->NumberConfiguredPipes));
+	return status;
+}
+
+/*
+ * Session trace, see USBCHIEF_TRACE_RECORD. Callable up to DISPATCH_LEVEL;
+ * while not recording it costs a single test.
+ */
+static VOID UsbChief_Trace(IN PDEVICE_CONTEXT DeviceContext, IN UCHAR Type,
+			   IN UCHAR EndpointAddress, IN ULONGLONG StartTime, IN NTSTATUS Status,
+			   IN ULONG Code, IN ULONG Length, IN ULONG Information,
+			   IN PVOID Payload, IN ULONG PayloadLength)
+{
+	PTRACE trace = &DeviceContext->Trace;
+	PUSBCHIEF_TRACE_RECORD record;
+	ULONGLONG now;
+
+	if (!trace->Size)
+		return;
+
+	now = KeQueryPerformanceCounter(NULL).QuadPart;
+	PayloadLength = min(PayloadLength, TRACE_PAYLOAD_SIZE);
+
+	WdfSpinLockAcquire(trace->Lock);
+	if (trace->Size) {
+		record = &trace->Records[trace->Head];
+		record->StartTime = StartTime ? StartTime : now;
+		record->Timestamp = now;
+		record->Sequence = trace->Sequence++;
+		record->Type = Type;
+		record->EndpointAddress = EndpointAddress;
+		record->PayloadLength = (WORD)PayloadLength;
+		record->Status = Status;
+		record->Code = Code;
+		record->Length = Length;
+		record->Information = Information;
+		RtlZeroMemory(record->Payload, sizeof(record->Payload));
+		if (PayloadLength)
+			RtlCopyMemory(record->Payload, Payload, PayloadLength);
+
+		trace->Head = (trace->Head + 1) % trace->Size;
+		if (trace->Used < trace->Size)
+			trace->Used++;
+	}
+	WdfSpinLockRelease(trace->Lock);
+}
+
+/* Records == 0 stops recording; otherwise a new empty ring replaces the old one */
+static NTSTATUS UsbChief_TraceStart(IN WDFDEVICE Device, IN ULONG Records)
+{
+	PTRACE trace = &GetDeviceContext(Device)->Trace;
+	PUSBCHIEF_TRACE_RECORD records = NULL;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDFMEMORY memory = NULL, old;
+	NTSTATUS status;
+
+	if (Records > TRACE_MAX_RECORDS)
+		return STATUS_INVALID_PARAMETER;
+
+	if (Records) {
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = Device;
+
+		status = WdfMemoryCreate(&attributes, NonPagedPool, POOL_TAG,
+					 Records * sizeof(*records), &memory, (PVOID *)&records);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+
+	WdfSpinLockAcquire(trace->Lock);
+	old = trace->Memory;
+	trace->Memory = memory;
+	trace->Records = records;
+	trace->Size = Records;
+	trace->Head = 0;
+	trace->Used = 0;
+	trace->Sequence = 0;
+	WdfSpinLockRelease(trace->Lock);
+
+	if (old)
+		WdfObjectDelete(old);
+	return STATUS_SUCCESS;
+}
+
+/* move up to Count of the oldest records out of the ring */
+static ULONG UsbChief_TraceGet(IN PDEVICE_CONTEXT DeviceContext,
+			       OUT PUSBCHIEF_TRACE_RECORD Records, IN ULONG Count)
+{
+	PTRACE trace = &DeviceContext->Trace;
+	ULONG first, chunk, n;
+
+	WdfSpinLockAcquire(trace->Lock);
+	n = min(Count, trace->Used);
+	if (n) {
+		first = (trace->Head + trace->Size - trace->Used) % trace->Size;
+		chunk = min(n, trace->Size - first);
+		RtlCopyMemory(Records, &trace->Records[first], chunk * sizeof(*Records));
+		RtlCopyMemory(Records + chunk, trace->Records, (n - chunk) * sizeof(*Records));
+		trace->Used -= n;
+	}
+	WdfSpinLockRelease(trace->Lock);
+	return n;
+}
+
+/* pipe counters start over when the pipe table is rebuilt */
+static ULONGLONG UsbChief_AnalyticsDelta(IN LONG64 New, IN LONG64 Old)
+{
+	return New >= Old ? New - Old : New;
+}
+
+/* upper bound in us of the bucket that holds Percent of the stages */
+static DWORD UsbChief_AnalyticsPercentile(IN DWORD *Latency, IN ULONG Percent)
+{
+	ULONG count = 0, sum = 0, target, b;
+
+	for (b = 0; b < ANALYTICS_BUCKETS; b++)
+		count += Latency[b];
+	if (!count)
+		return 0;
+
+	target = (ULONG)(((ULONGLONG)count * Percent + 99) / 100);
+	for (b = 0; b < ANALYTICS_BUCKETS - 1; b++) {
+		sum += Latency[b];
+		if (sum >= target)
+			break;
+	}
+	return 1UL << b;
+}
+
+/*
+ * Sample the pipe counters at the end of an interval and publish what
+ * changed since the sample Windows intervals back. Fixed memory whatever
+ * the capture length: Windows + 1 samples and the snapshot.
+ */
+static VOID UsbChief_AnalyticsTimer(IN WDFTIMER Timer)
+{
+	PDEVICE_CONTEXT deviceContext = GetDeviceContext(WdfTimerGetParentObject(Timer));
+	PANALYTICS analytics = GetAnalytics(Timer);
+	PUSBCHIEF_ANALYTICS snapshot = &analytics->Snapshot;
+	PUSBCHIEF_PIPE_ANALYTICS pipe;
+	PANALYTICS_SAMPLE sample, old;
+	ULONGLONG ticks, frequency;
+	ULONG count, windows, taken, sequence, top, i, j;
+
+	frequency = deviceContext->CounterFrequency;
+	count = min(deviceContext->NumberConfiguredPipes, USBCHIEF_MAX_PIPES);
+
+	sample = &analytics->Samples[analytics->Next];
+	sample->Time = KeQueryPerformanceCounter(NULL).QuadPart;
+	RtlZeroMemory(sample->Pipes, sizeof(sample->Pipes));
+	for (i = 0; i < count; i++) {
+		/* the 64-bit counters could tear on x86 with a plain copy */
+		sample->Pipes[i] = deviceContext->Pipes[i].Stats;
+		sample->Pipes[i].Transfers =
+			InterlockedCompareExchange64(&deviceContext->Pipes[i].Stats.Transfers, 0, 0);
+		sample->Pipes[i].Bytes =
+			InterlockedCompareExchange64(&deviceContext->Pipes[i].Stats.Bytes, 0, 0);
+	}
+
+	windows = min(analytics->Filled, analytics->Windows);
+	old = &analytics->Samples[(analytics->Next + analytics->Windows + 1 - windows) %
+				  (analytics->Windows + 1)];
+	analytics->Next = (analytics->Next + 1) % (analytics->Windows + 1);
+	if (analytics->Filled <= analytics->Windows)
+		analytics->Filled++;
+
+	ticks = sample->Time - old->Time;
+	if (!windows || !ticks)
+		return;
+
+	WdfSpinLockAcquire(deviceContext->AnalyticsLock);
+	sequence = snapshot->Sequence;
+	RtlZeroMemory(snapshot, sizeof(*snapshot));
+	snapshot->Sequence = sequence + 1;
+	snapshot->Windows = windows;
+	snapshot->Timestamp = sample->Time;
+	snapshot->Duration = ticks * 1000000 / frequency;
+	snapshot->NumberOfPipes = (BYTE)count;
+
+	for (i = 0; i < count; i++) {
+		pipe = &snapshot->Pipes[i];
+		pipe->EndpointAddress = deviceContext->Pipes[i].EndpointAddress;
+		pipe->Transfers = (DWORD)UsbChief_AnalyticsDelta(sample->Pipes[i].Transfers,
+								 old->Pipes[i].Transfers);
+		pipe->Errors = (DWORD)UsbChief_AnalyticsDelta(sample->Pipes[i].Errors,
+							      old->Pipes[i].Errors);
+		pipe->ShortTransfers = (DWORD)UsbChief_AnalyticsDelta(sample->Pipes[i].ShortTransfers,
+								      old->Pipes[i].ShortTransfers);
+		pipe->Bytes = UsbChief_AnalyticsDelta(sample->Pipes[i].Bytes, old->Pipes[i].Bytes);
+		pipe->Bandwidth = pipe->Bytes * frequency / ticks;
+
+		for (j = 0; j < ANALYTICS_BUCKETS; j++)
+			pipe->Latency[j] = (DWORD)UsbChief_AnalyticsDelta(sample->Pipes[i].Latency[j],
+									  old->Pipes[i].Latency[j]);
+		pipe->LatencyP50 = UsbChief_AnalyticsPercentile(pipe->Latency, 50);
+		pipe->LatencyP90 = UsbChief_AnalyticsPercentile(pipe->Latency, 90);
+		pipe->LatencyP99 = UsbChief_AnalyticsPercentile(pipe->Latency, 99);
+
+		snapshot->Bytes += pipe->Bytes;
+		snapshot->Transfers += pipe->Transfers;
+		snapshot->Errors += pipe->Errors;
+	}
+	snapshot->Bandwidth = snapshot->Bytes * frequency / ticks;
+
+	/* with at most USBCHIEF_MAX_PIPES candidates the exact top is cheap */
+	taken = 0;
+	for (j = 0; j < ANALYTICS_TOP; j++) {
+		top = count;
+		for (i = 0; i < count; i++) {
+			if (!(taken & (1UL << i)) && snapshot->Pipes[i].Bytes &&
+			    (top == count || snapshot->Pipes[i].Bytes > snapshot->Pipes[top].Bytes))
+				top = i;
+		}
+		if (top == count)
+			break;
+		taken |= 1UL << top;
+		snapshot->Busiest[j] = snapshot->Pipes[top].EndpointAddress;
+	}
+	WdfSpinLockRelease(deviceContext->AnalyticsLock);
+}
+
+/* Interval 0 stops; otherwise the statistics start over with the new window */
+static NTSTATUS UsbChief_AnalyticsSet(IN WDFDEVICE Device, IN PUSBCHIEF_ANALYTICS_PARAMS Params)
+{
+	PDEVICE_CONTEXT deviceContext = GetDeviceContext(Device);
+	PANALYTICS analytics;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_TIMER_CONFIG timerConfig;
+	WDFTIMER timer;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	if (Params->Interval && (Params->Interval < ANALYTICS_MIN_INTERVAL || !Params->Windows ||
+				 Params->Windows > ANALYTICS_MAX_WINDOWS))
+		return STATUS_INVALID_PARAMETER;
+
+	/* the timer is swapped outside AnalyticsLock, callers must not interleave */
+	WdfWaitLockAcquire(deviceContext->AnalyticsSetLock, NULL);
+
+	analytics = deviceContext->Analytics;
+	if (analytics) {
+		WdfTimerStop(analytics->Timer, TRUE);
+		WdfSpinLockAcquire(deviceContext->AnalyticsLock);
+		deviceContext->Analytics = NULL;
+		WdfSpinLockRelease(deviceContext->AnalyticsLock);
+		WdfObjectDelete(analytics->Timer);
+	}
+
+	if (!Params->Interval)
+		goto out;
+
+	WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, UsbChief_AnalyticsTimer, Params->Interval);
+	timerConfig.AutomaticSerialization = FALSE;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(&attributes, ANALYTICS);
+	attributes.ParentObject = Device;
+
+	status = WdfTimerCreate(&timerConfig, &attributes, &timer);
+	if (!NT_SUCCESS(status))
+		goto out;
+
+	analytics = GetAnalytics(timer);
+	analytics->Timer = timer;
+	analytics->Windows = Params->Windows;
+
+	/* the first sample only marks where the window starts */
+	UsbChief_AnalyticsTimer(timer);
+
+	WdfSpinLockAcquire(deviceContext->AnalyticsLock);
+	deviceContext->Analytics = analytics;
+	WdfSpinLockRelease(deviceContext->AnalyticsLock);
+
+	WdfTimerStart(timer, WDF_REL_TIMEOUT_IN_MS(Params->Interval));
+out:
+	WdfWaitLockRelease(deviceContext->AnalyticsSetLock);
+	return status;
+}
+
+static NTSTATUS UsbChief_AnalyticsGet(IN PDEVICE_CONTEXT DeviceContext,
+				      OUT PUSBCHIEF_ANALYTICS Snapshot)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	WdfSpinLockAcquire(DeviceContext->AnalyticsLock);
+	if (DeviceContext->Analytics)
+		*Snapshot = DeviceContext->Analytics->Snapshot;
+	else
+		status = STATUS_INVALID_DEVICE_REQUEST;
+	WdfSpinLockRelease(DeviceContext->AnalyticsLock);
+	return status;
+}
+
+static NTSTATUS UsbChief_ResetDevice(IN WDFDEVICE Device)
+{
+	PDEVICE_CONTEXT pDeviceContext;
+	NTSTATUS status;
+
+	UsbChief_DbgPrint(0, ("\n"));
+
+	PAGED_CODE();
+
+	pDeviceContext = GetDeviceContext(Device);
+
+	UsbChief_StopAllPipes(pDeviceContext);
+
+	status = WdfUsbTargetDeviceIsConnectedSynchronous(pDeviceContext->WdfUsbTargetDevice);
+
+	if(NT_SUCCESS(status)) {
+		status = WdfUsbTargetDeviceResetPortSynchronously(pDeviceContext->WdfUsbTargetDevice);
+	}
+
+	UsbChief_StartAllPipes(pDeviceContext);
+	return status;
+}
+
+static NTSTATUS UsbChief_ResetPipe(IN WDFUSBPIPE Pipe)
+{
+	NTSTATUS status;
+
+	PAGED_CODE();
+
+	status = WdfUsbTargetPipeResetSynchronously(Pipe, WDF_NO_HANDLE, NULL);
+
+	if (NT_SUCCESS(status)) {
+		UsbChief_DbgPrint(DEBUG_CONFIG, ("success\n"));
+		status = STATUS_SUCCESS;
+	}
+	else {
+		UsbChief_DbgPrint(0, ("failed\n"));
+	}
+	return status;
+}
+
+static VOID UsbChief_ReadWriteWorkItem(IN WDFWORKITEM  WorkItem)
+{
+	PWORKITEM_CONTEXT pItemContext;
+	PDEVICE_CONTEXT deviceContext;
+	ULONGLONG startTime = 0;
+	NTSTATUS status;
+
+	UsbChief_DbgPrint(DEBUG_RW, ("called\n"));
+
+	pItemContext = GetWorkItemContext(WorkItem);
+	deviceContext = GetDeviceContext(pItemContext->Device);
+
+	/* a setting switch since the error replaced the pipe, nothing to reset */
+	UsbChief_DispatchEnter(deviceContext);
+	if (pItemContext->SettingGeneration != deviceContext->SettingGeneration ||
+	    !pItemContext->PipeContext->Pipe) {
+		UsbChief_DbgPrint(DEBUG_RW, ("setting switched, no reset\n"));
+		goto out;
+	}
+
+	if (deviceContext->Trace.Size)
+		startTime = KeQueryPerformanceCounter(NULL).QuadPart;
+	status = UsbChief_ResetPipe(pItemContext->PipeContext->Pipe);
+
+	UsbChief_Trace(deviceContext, TRACE_RESET, pItemContext->PipeContext->EndpointAddress,
+		       startTime, status, 0, 0, 0, NULL, 0);
+	if (!NT_SUCCESS(status)) {
+		status = UsbChief_ResetDevice(pItemContext->Device);
+		if(!NT_SUCCESS(status))
+			UsbChief_DbgPrint(0, ("ResetDevice failed 0x%x\n", status));
+	}
+out:
+	UsbChief_DispatchLeave(deviceContext);
+	WdfObjectDelete(WorkItem);
+}
+
+static NTSTATUS UsbChief_QueuePassiveLevelCallback(IN WDFDEVICE    Device,
+				   IN PPIPE_CONTEXT PipeContext)
+{
+	NTSTATUS                       status = STATUS_SUCCESS;
+	PWORKITEM_CONTEXT               context;
+	WDF_OBJECT_ATTRIBUTES           attributes;
+	WDF_WORKITEM_CONFIG             workitemConfig;
+	WDFWORKITEM                     hWorkItem;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(&attributes, WORKITEM_CONTEXT);
+	attributes.ParentObject = Device;
+
+	WDF_WORKITEM_CONFIG_INIT(&workitemConfig, UsbChief_ReadWriteWorkItem);
+
+	status = WdfWorkItemCreate( &workitemConfig,
+				    &attributes,
+				    &hWorkItem);
+
+	if (!NT_SUCCESS(status))
+		return status;
+
+	context = GetWorkItemContext(hWorkItem);
+
+	context->Device = Device;
+	context->PipeContext = PipeContext;
+	context->SettingGeneration = GetDeviceContext(Device)->SettingGeneration;
+
+	WdfWorkItemEnqueue(hWorkItem);
+	return STATUS_SUCCESS;
+}
+
+
+static VOID UsbChief_InitCrc32c(VOID)
+{
+	ULONG i, j, crc;
+	int info[4];
+
+	for (i = 0; i < 256; i++) {
+		crc = i;
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+		Crc32cTable[i] = crc;
+	}
+
+	/* CPUID.1:ECX bit 20 is SSE4.2, which brings the CRC32 instruction */
+	__cpuid(info, 1);
+	Crc32cHardware = (info[2] & (1 << 20)) ? TRUE : FALSE;
+
+	UsbChief_DbgPrint(DEBUG_CONFIG, ("CRC32C: %s\n", Crc32cHardware ? "SSE4.2" : "table"));
+}
+
+static ULONG UsbChief_Crc32c(IN PUCHAR Buffer, IN ULONG Length)
+{
+	ULONG crc = 0xffffffff;
+
+	if (Crc32cHardware) {
+#if defined(_M_AMD64)
+		ULONG64 crc64 = crc;
+
+		for (; Length >= sizeof(ULONG64); Length -= sizeof(ULONG64), Buffer += sizeof(ULONG64))
+			crc64 = _mm_crc32_u64(crc64, *(ULONG64 UNALIGNED *)Buffer);
+		crc = (ULONG)crc64;
+#endif
+		for (; Length >= sizeof(ULONG); Length -= sizeof(ULONG), Buffer += sizeof(ULONG))
+			crc = _mm_crc32_u32(crc, *(ULONG UNALIGNED *)Buffer);
+		for (; Length; Length--)
+			crc = _mm_crc32_u8(crc, *Buffer++);
+	} else {
+		for (; Length; Length--)
+			crc = Crc32cTable[(crc ^ *Buffer++) & 0xff] ^ (crc >> 8);
+	}
+	return ~crc;
+}
+
+static VOID UsbChief_InitFrameHeader(IN PDEVICE_CONTEXT DeviceContext,
+				     IN PPIPE_CONTEXT PipeContext,
+				     OUT PUSBCHIEF_FRAME_HEADER Header,
+				     IN ULONG Length, IN WORD Flags)
+{
+	RtlZeroMemory(Header, sizeof(*Header));
+	Header->Magic = USBCHIEF_FRAME_MAGIC;
+	Header->HeaderLength = sizeof(*Header);
+	Header->Flags = Flags;
+	Header->Length = Length;
+	Header->Sequence = (DWORD)InterlockedIncrement(&DeviceContext->FrameSequence);
+	Header->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+	if (PipeContext) {
+		Header->EndpointAddress = PipeContext->EndpointAddress;
+		Header->Pipe = PipeContext->Index;
+	}
+}
+
+/*
+ * Payload size of the next framed stage: whatever fits behind a header at
+ * FrameOffset, rounded down to whole packets so the device cannot babble.
+ */
+static ULONG UsbChief_FramedStageLength(IN PREQUEST_CONTEXT rwContext)
+{
+	ULONG room;
+
+	if (rwContext->FrameOffset + sizeof(USBCHIEF_FRAME_HEADER) >= rwContext->TotalLength)
+		return 0;
+
+	room = rwContext->TotalLength - rwContext->FrameOffset - sizeof(USBCHIEF_FRAME_HEADER);
+	if (room > rwContext->PipeContext->StageSize)
+		room = rwContext->PipeContext->StageSize;
+
+	if (rwContext->MaximumPacketSize)
+		room -= room % rwContext->MaximumPacketSize;
+	return room;
+}
+
+/*
+ * Close the frame of the stage that just completed and move FrameOffset
+ * behind it. Padding is zeroed as it is returned to the caller.
+ */
+static VOID UsbChief_CompleteFrame(IN PDEVICE_CONTEXT DeviceContext,
+				   IN PREQUEST_CONTEXT rwContext, IN ULONG bytesRead,
+				   IN WORD Flags)
+{
+	USBCHIEF_FRAME_HEADER header;
+	ULONG end, next;
+
+	UsbChief_InitFrameHeader(DeviceContext, rwContext->PipeContext, &header, bytesRead,
+				 Flags | USBCHIEF_FRAME_CRC32C);
+	header.Crc32c = UsbChief_Crc32c(rwContext->FrameBuffer + rwContext->FrameOffset +
+					sizeof(header), bytesRead);
+	RtlCopyMemory(rwContext->FrameBuffer + rwContext->FrameOffset,
+		      &header, sizeof(header));
+
+	end = rwContext->FrameOffset + sizeof(header) + bytesRead;
+	next = USBCHIEF_FRAME_ALIGN_UP(end);
+	if (next > rwContext->TotalLength)
+		next = rwContext->TotalLength;
+
+	RtlZeroMemory(rwContext->FrameBuffer + end, next - end);
+	rwContext->FrameOffset = next;
+	rwContext->Numxfer = next;
+}
+
+static BOOLEAN UsbChief_SendStage(IN WDFREQUEST Request, IN WDFUSBPIPE Pipe,
+				  IN PREQUEST_CONTEXT rwContext)
+{
+	WDF_REQUEST_SEND_OPTIONS options;
+
+	rwContext->StageTime = KeQueryPerformanceCounter(NULL).QuadPart;
+	if (!rwContext->ReadTimeout)
+		return WdfRequestSend(Request, WdfUsbTargetPipeGetIoTarget(Pipe), WDF_NO_SEND_OPTIONS);
+
+	WDF_REQUEST_SEND_OPTIONS_INIT(&options, 0);
+	WDF_REQUEST_SEND_OPTIONS_SET_TIMEOUT(&options, WDF_REL_TIMEOUT_IN_MS(rwContext->ReadTimeout));
+	return WdfRequestSend(Request, WdfUsbTargetPipeGetIoTarget(Pipe), &options);
+}
+
+/* account a completed stage in the pipe statistics */
+static VOID UsbChief_CountStage(IN PDEVICE_CONTEXT DeviceContext, IN PPIPE_CONTEXT PipeContext,
+				IN ULONG Length, IN ULONG BytesRead, IN ULONGLONG Latency)
+{
+	ULONGLONG us;
+	ULONG bucket = 0;
+
+	InterlockedIncrement64(&PipeContext->Stats.Transfers);
+	InterlockedExchangeAdd64(&PipeContext->Stats.Bytes, BytesRead);
+	if (BytesRead < Length)
+		InterlockedIncrement(&PipeContext->Stats.ShortTransfers);
+
+	for (us = Latency * 1000000 / DeviceContext->CounterFrequency;
+	     us && bucket < ANALYTICS_BUCKETS - 1; us >>= 1)
+		bucket++;
+	InterlockedIncrement(&PipeContext->Stats.Latency[bucket]);
+}
+
+/* complete a client read and note it in the trace */
+static VOID UsbChief_CompleteRead(IN PDEVICE_CONTEXT DeviceContext, IN WDFREQUEST Request,
+				  IN NTSTATUS Status, IN ULONG Information)
+{
+	PFILE_CONTEXT fileContext;
+	WDF_REQUEST_PARAMETERS params;
+
+	if (DeviceContext->Trace.Size) {
+		fileContext = GetFileContext(WdfRequestGetFileObject(Request));
+		WDF_REQUEST_PARAMETERS_INIT(&params);
+		WdfRequestGetParameters(Request, &params);
+		UsbChief_Trace(DeviceContext, TRACE_READ,
+			       fileContext->PipeContext ? fileContext->PipeContext->EndpointAddress : 0,
+			       GetRequestContext(Request)->StartTime, Status, fileContext->ReadMode,
+			       (ULONG)params.Parameters.Read.Length, Information, NULL, 0);
+	}
+	WdfRequestCompleteWithInformation(Request, Status, Information);
+}
+
+static VOID UsbChief_ReadCompletion(IN WDFREQUEST Request, IN WDFIOTARGET Target,
+			     PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+			     IN WDFCONTEXT Context)
+{
+	PMDL requestMdl;
+	WDFUSBPIPE pipe;
+	ULONG stageLength;
+	NTSTATUS status;
+	PREQUEST_CONTEXT rwContext;
+	PURB urb;
+	ULONG bytesRead;
+	BOOLEAN endOfTransfer, timedOut;
+	PDEVICE_CONTEXT deviceContext;
+
+	UNREFERENCED_PARAMETER(Context);
+	rwContext = GetRequestContext(Request);
+	deviceContext = GetDeviceContext(WdfIoTargetGetDevice(Target));
+
+	pipe = (WDFUSBPIPE)Target;
+	status = CompletionParams->IoStatus.Status;
+
+	/* a timed out stage was cancelled, but what it transferred is valid */
+	timedOut = (status == STATUS_IO_TIMEOUT && rwContext->ReadTimeout);
+	if (timedOut)
+		status = STATUS_SUCCESS;
+
+	urb = (PURB) WdfMemoryGetBuffer(rwContext->UrbMemory, NULL);
+	bytesRead = NT_SUCCESS(status) ? urb->UrbBulkOrInterruptTransfer.TransferBufferLength : 0;
+
+	UsbChief_Trace(deviceContext, TRACE_STAGE, rwContext->PipeContext->EndpointAddress,
+		       rwContext->StageTime, CompletionParams->IoStatus.Status, 0,
+		       rwContext->StageLength, bytesRead, NULL, 0);
+
+	if (!NT_SUCCESS(status)){
+		/* cancelled by a pipe stop, e.g. for a setting switch; the pipe is fine */
+		if (status != STATUS_CANCELLED) {
+			InterlockedIncrement(&rwContext->PipeContext->Stats.Errors);
+			UsbChief_QueuePassiveLevelCallback(WdfIoTargetGetDevice(Target), rwContext->PipeContext);
+		}
+		goto End;
+	}
+
+	UsbChief_CountStage(deviceContext, rwContext->PipeContext, rwContext->StageLength, bytesRead,
+			    KeQueryPerformanceCounter(NULL).QuadPart - rwContext->StageTime);
+	endOfTransfer = !timedOut && bytesRead < rwContext->StageLength;
+
+	if (rwContext->ReadMode & READ_MODE_FRAMED) {
+		if (bytesRead || !timedOut)
+			UsbChief_CompleteFrame(deviceContext, rwContext, bytesRead,
+					       endOfTransfer ? USBCHIEF_FRAME_END_OF_TRANSFER : 0);
+
+		stageLength = UsbChief_FramedStageLength(rwContext);
+		if (!stageLength || (timedOut && rwContext->Numxfer) ||
+		    (endOfTransfer && (rwContext->ReadMode & READ_MODE_TRANSFER))) {
+			WdfRequestSetInformation(Request, rwContext->Numxfer);
+			goto End;
+		}
+		rwContext->VirtualAddress = rwContext->BaseAddress + rwContext->FrameOffset +
+			sizeof(USBCHIEF_FRAME_HEADER);
+		rwContext->Length = rwContext->TotalLength - rwContext->FrameOffset;
+	} else {
+		if (timedOut && !bytesRead && !rwContext->Numxfer) {
+			/* nothing arrived yet, post the same stage again */
+			rwContext->VirtualAddress -= rwContext->StageLength;
+			rwContext->Length += rwContext->StageLength;
+		}
+
+		rwContext->Numxfer += bytesRead;
+
+		if (rwContext->Length == 0 || (timedOut && rwContext->Numxfer) ||
+		    (endOfTransfer && (rwContext->ReadMode & READ_MODE_TRANSFER))) {
+			WdfRequestSetInformation(Request, rwContext->Numxfer);
+			goto End;
+		}
+
+		if (rwContext->Length > rwContext->PipeContext->StageSize)
+			stageLength = rwContext->PipeContext->StageSize;
+		else
+			stageLength = rwContext->Length;
+	}
+
+	UsbChief_DbgPrint(DEBUG_RW, ("Stage next Read transfer... %d bytes remaing\n", rwContext->Length));
+	MmPrepareMdlForReuse(rwContext->Mdl);
+
+	status = WdfRequestRetrieveOutputWdmMdl(Request, &requestMdl);
+	if(!NT_SUCCESS(status)){
+		UsbChief_DbgPrint(0, ("WdfRequestRetrieveOutputWdmMdl for Read failed %x\n", status));
+		goto End;
+	}
+
+	IoBuildPartialMdl(requestMdl, rwContext->Mdl,
+			  (PVOID) rwContext->VirtualAddress, stageLength);
+
+	urb->UrbBulkOrInterruptTransfer.TransferBufferLength = stageLength;
+
+	rwContext->StageLength = stageLength;
+	rwContext->VirtualAddress += stageLength;
+	rwContext->Length -= stageLength;
+
+	status = WdfUsbTargetPipeFormatRequestForUrb(pipe, Request,
+						     rwContext->UrbMemory, NULL);
+	if (!NT_SUCCESS(status)) {
+		UsbChief_DbgPrint(0, ("Failed to format requset for urb\n"));
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto End;
+	}
+
+	WdfRequestSetCompletionRoutine(Request, UsbChief_ReadCompletion, NULL);
+
+	if (!UsbChief_SendStage(Request, pipe, rwContext)) {
+		UsbChief_DbgPrint(0, ("WdfRequestSend for Read failed\n"));
+		status = WdfRequestGetStatus(Request);
+		goto End;
+	}
+	return;
+
+End:
+	IoFreeMdl(rwContext->Mdl);
+
+	UsbChief_DbgPrint(DEBUG_RW, ("Read request completed with status 0x%x\n", status));
+	UsbChief_CompleteRead(deviceContext, Request, status,
+			      NT_SUCCESS(status) ? rwContext->Numxfer : 0);
+}
+
+static VOID UsbChief_ReadEndPoint(IN WDFQUEUE Queue, IN WDFREQUEST Request,
 			   IN ULONG totalLength)
 {
-	PMDL                    newMdl=NULL, requestMdl = NULL;
-	PURB                    urb = NULL;
-	WDFMEMORY               urbMemory;
-	ULONG                   stageLength = 0;
-	NTSTATUS                status;
-	ULONG_PTR               virtualAddress = 0;
-	PREQUEST_CONTEXT        rwContext = NULL;
-	PFILE_CONTEXT           fileContext = NULL;
-	WDFUSBPIPE              pipe;
-	WDF_USB_PIPE_INFORMATION   pipeInfo;
-	WDF_OBJECT_ATTRIBUTES   objectAttribs;
-	USBD_PIPE_HANDLE        usbdPipeHandle;
-	PDEVICE_CONTEXT         deviceContext;
+	PMDL                    newMdl=NULL, requestMdl = NULL;
+	PURB                    urb = NULL;
+	WDFMEMORY               urbMemory;
+	ULONG                   stageLength = 0;
+	NTSTATUS                status;
+	ULONG_PTR               virtualAddress = 0;
+	PREQUEST_CONTEXT        rwContext = NULL;
+	PFILE_CONTEXT           fileContext = NULL;
+	PPIPE_CONTEXT           pipeContext;
+	WDFUSBPIPE              pipe;
+	WDF_OBJECT_ATTRIBUTES   objectAttribs;
+	PDEVICE_CONTEXT         deviceContext;
+	PVOID                   frameBuffer = NULL;
+
+	UsbChief_DbgPrint(DEBUG_RW, ("UsbChief_DispatchReadWrite - begins\n"));
+
+	deviceContext = GetDeviceContext(WdfIoQueueGetDevice(Queue));
+	fileContext = GetFileContext(WdfRequestGetFileObject(Request));
+	pipe = fileContext->Pipe;
+	pipeContext = fileContext->PipeContext;
+
+	rwContext = GetRequestContext(Request);
+
+	status = WdfRequestRetrieveOutputWdmMdl(Request, &requestMdl);
+	if(!NT_SUCCESS(status)){
+		UsbChief_DbgPrint(0, ("WdfRequestRetrieveOutputWdmMdl failed %x\n", status));
+		goto Exit;
+	}
+	virtualAddress = (ULONG_PTR) MmGetMdlVirtualAddress(requestMdl);
+
+	rwContext->ReadMode = fileContext->ReadMode;
+	rwContext->ReadTimeout = fileContext->ReadTimeout;
+	rwContext->MaximumPacketSize = pipeContext->MaximumPacketSize;
+	rwContext->PipeContext = pipeContext;
+	rwContext->BaseAddress = virtualAddress;
+	rwContext->TotalLength = totalLength;
+	rwContext->FrameOffset = 0;
+
+	if (rwContext->ReadMode & READ_MODE_FRAMED) {
+		status = WdfRequestRetrieveOutputBuffer(Request, sizeof(USBCHIEF_FRAME_HEADER),
+							&frameBuffer, NULL);
+		if (!NT_SUCCESS(status))
+			goto Exit;
+
+		rwContext->FrameBuffer = frameBuffer;
+
+		stageLength = UsbChief_FramedStageLength(rwContext);
+		if (!stageLength) {
+			status = STATUS_BUFFER_TOO_SMALL;
+			goto Exit;
+		}
+	} else if (totalLength > pipeContext->StageSize)
+		stageLength = pipeContext->StageSize;
+	else
+		stageLength = totalLength;
+
+	newMdl = IoAllocateMdl((PVOID) virtualAddress, totalLength,
+			       FALSE, FALSE, NULL);
+
+	if (!newMdl) {
+		UsbChief_DbgPrint(0, ("Failed to alloc mem for mdl\n"));
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Exit;
+	}
+
+	if (rwContext->ReadMode & READ_MODE_FRAMED)
+		virtualAddress += sizeof(USBCHIEF_FRAME_HEADER);
+
+	IoBuildPartialMdl(requestMdl, newMdl, (PVOID)virtualAddress,
+			  stageLength);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttribs);
+	objectAttribs.ParentObject = Request;
+
+	status = WdfMemoryCreate(&objectAttribs,
+				 NonPagedPool,
+				 POOL_TAG,
+				 sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
+				 &urbMemory,
+				 (PVOID*) &urb);
+
+	if (!NT_SUCCESS(status)) {
+		UsbChief_DbgPrint(0, ("Failed to alloc mem for urb\n"));
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Exit;
+	}
+
+	UsbBuildInterruptOrBulkTransferRequest(urb,
+					       sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
+					       pipeContext->UsbdPipeHandle,
+					       NULL,
+					       newMdl,
+					       stageLength,
+					       USBD_TRANSFER_DIRECTION_IN |
+					       USBD_SHORT_TRANSFER_OK,
+					       NULL);
+
+	status = WdfUsbTargetPipeFormatRequestForUrb(pipe, Request, urbMemory, NULL  );
+	if (!NT_SUCCESS(status)) {
+		UsbChief_DbgPrint(0, ("Failed to format requset for urb\n"));
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Exit;
+	}
+	WdfRequestSetCompletionRoutine(Request, UsbChief_ReadCompletion, NULL);
+
+	rwContext->UrbMemory       = urbMemory;
+	rwContext->Mdl             = newMdl;
+	rwContext->Length          = totalLength - stageLength;
+	rwContext->StageLength     = stageLength;
+	rwContext->Numxfer         = 0;
+	rwContext->VirtualAddress  = virtualAddress + stageLength;
+
+	if (!UsbChief_SendStage(Request, pipe, rwContext)) {
+		status = WdfRequestGetStatus(Request);
+		ASSERT(!NT_SUCCESS(status));
+	}
+
+Exit:
+	if (!NT_SUCCESS(status)) {
+		UsbChief_CompleteRead(deviceContext, Request, status, 0);
+
+		if (newMdl != NULL) {
+			IoFreeMdl(newMdl);
+		}
+	}
+}
+
+
+/*
+ * Read-ahead ring. All helpers below expect ReadAhead->Lock to be held.
+ */
+static VOID UsbChief_RingPeek(IN PREAD_AHEAD ReadAhead, IN ULONG Offset,
+			      OUT PVOID Buffer, IN ULONG Length)
+{
+	ULONG pos, first;
+
+	pos = (ReadAhead->Tail + Offset) % ReadAhead->Size;
+	first = min(Length, ReadAhead->Size - pos);
+
+	RtlCopyMemory(Buffer, ReadAhead->Ring + pos, first);
+	RtlCopyMemory((PUCHAR)Buffer + first, ReadAhead->Ring, Length - first);
+}
+
+static VOID UsbChief_RingPoke(IN PREAD_AHEAD ReadAhead, IN ULONG Offset,
+			      IN PVOID Buffer, IN ULONG Length)
+{
+	ULONG pos, first;
+
+	pos = (ReadAhead->Tail + Offset) % ReadAhead->Size;
+	first = min(Length, ReadAhead->Size - pos);
+
+	if (Buffer) {
+		RtlCopyMemory(ReadAhead->Ring + pos, Buffer, first);
+		RtlCopyMemory(ReadAhead->Ring, (PUCHAR)Buffer + first, Length - first);
+	} else {
+		RtlZeroMemory(ReadAhead->Ring + pos, first);
+		RtlZeroMemory(ReadAhead->Ring, Length - first);
+	}
+}
+
+static VOID UsbChief_RingAppend(IN PREAD_AHEAD ReadAhead, IN PVOID Buffer,
+				IN ULONG Length)
+{
+	UsbChief_RingPoke(ReadAhead, ReadAhead->Used, Buffer, Length);
+	ReadAhead->Used += Length;
+}
+
+static VOID UsbChief_RingConsume(IN PREAD_AHEAD ReadAhead, IN ULONG Length)
+{
+	ReadAhead->Tail = (ReadAhead->Tail + Length) % ReadAhead->Size;
+	ReadAhead->Used -= Length;
+	ReadAhead->FrameConsumed = 0;
+}
+
+#define GAP_FRAME_LENGTH \
+	USBCHIEF_FRAME_ALIGN_UP(sizeof(USBCHIEF_FRAME_HEADER) + sizeof(USBCHIEF_GAP_RECORD))
+
+static VOID UsbChief_MergeGap(IN OUT PUSBCHIEF_GAP_RECORD Gap, IN PUSBCHIEF_GAP_RECORD Other)
+{
+	if (!Gap->Reason || Other->FirstTimestamp < Gap->FirstTimestamp)
+		Gap->FirstTimestamp = Other->FirstTimestamp;
+	if (Other->LastTimestamp > Gap->LastTimestamp)
+		Gap->LastTimestamp = Other->LastTimestamp;
+	Gap->LostBytes += Other->LostBytes;
+	Gap->LostFrames += Other->LostFrames;
+	Gap->Reason |= Other->Reason;
+}
+
+/* account a loss that will be reported in front of the next stored frame */
+static VOID UsbChief_ReadAheadNoteGap(IN PREAD_AHEAD ReadAhead, IN ULONGLONG First,
+				      IN ULONGLONG Last, IN ULONG Bytes, IN ULONG Reason)
+{
+	USBCHIEF_GAP_RECORD gap;
+
+	gap.FirstTimestamp = First;
+	gap.LastTimestamp = Last;
+	gap.LostBytes = Bytes;
+	gap.LostFrames = (Reason & USBCHIEF_GAP_OVERFLOW) ? 1 : 0;
+	gap.Reason = Reason;
+
+	if (!ReadAhead->GapPending)
+		RtlZeroMemory(&ReadAhead->Gap, sizeof(ReadAhead->Gap));
+	UsbChief_MergeGap(&ReadAhead->Gap, &gap);
+	ReadAhead->GapPending = TRUE;
+
+	if (Reason & USBCHIEF_GAP_OVERFLOW) {
+		ReadAhead->Overflows++;
+		ReadAhead->OverflowBytes += Bytes;
+	}
+}
+
+static VOID UsbChief_ReadAheadPutGap(IN PREAD_AHEAD ReadAhead, IN ULONG Offset,
+				     IN PUSBCHIEF_FRAME_HEADER Header,
+				     IN PUSBCHIEF_GAP_RECORD Gap)
+{
+	Header->Flags |= USBCHIEF_FRAME_GAP | USBCHIEF_FRAME_CRC32C;
+	Header->Length = sizeof(*Gap);
+	Header->Timestamp = Gap->FirstTimestamp;
+	Header->Crc32c = UsbChief_Crc32c((PUCHAR)Gap, sizeof(*Gap));
+
+	UsbChief_RingPoke(ReadAhead, Offset, Header, sizeof(*Header));
+	UsbChief_RingPoke(ReadAhead, Offset + sizeof(*Header), Gap, sizeof(*Gap));
+	ReadAhead->Gaps++;
+}
+
+/*
+ * OVERFLOW_POLICY_DROP_OLDEST: discard frames at the head of the ring until
+ * Needed bytes are free, and put a single gap frame, which also absorbs
+ * gap frames that were dropped, where they were.
+ */
+static VOID UsbChief_ReadAheadDropOldest(IN PREAD_AHEAD ReadAhead, IN ULONG Needed)
+{
+	USBCHIEF_FRAME_HEADER header;
+	USBCHIEF_GAP_RECORD gap, dropped;
+	ULONG frameLength, lost;
+	DWORD sequence = 0;
+
+	RtlZeroMemory(&gap, sizeof(gap));
+
+	while (ReadAhead->Used && ReadAhead->Size - ReadAhead->Used < Needed + GAP_FRAME_LENGTH) {
+		UsbChief_RingPeek(ReadAhead, 0, &header, sizeof(header));
+		frameLength = USBCHIEF_FRAME_ALIGN_UP(sizeof(header) + header.Length);
+
+		if (!gap.Reason)
+			sequence = header.Sequence;
+
+		if (header.Flags & USBCHIEF_FRAME_GAP) {
+			UsbChief_RingPeek(ReadAhead, sizeof(header), &dropped, sizeof(dropped));
+		} else {
+			lost = header.Length - ReadAhead->FrameConsumed;
+			dropped.FirstTimestamp = header.Timestamp;
+			dropped.LastTimestamp = header.Timestamp;
+			dropped.LostBytes = lost;
+			dropped.LostFrames = 1;
+			dropped.Reason = USBCHIEF_GAP_OVERFLOW;
+			ReadAhead->Overflows++;
+			ReadAhead->OverflowBytes += lost;
+		}
+		UsbChief_MergeGap(&gap, &dropped);
+		UsbChief_RingConsume(ReadAhead, frameLength);
+	}
+
+	if (!gap.Reason)
+		return;
+
+	RtlZeroMemory(&header, sizeof(header));
+	header.Magic = USBCHIEF_FRAME_MAGIC;
+	header.HeaderLength = sizeof(header);
+	header.Sequence = sequence;
+
+	ReadAhead->Tail = (ReadAhead->Tail + ReadAhead->Size - GAP_FRAME_LENGTH) % ReadAhead->Size;
+	ReadAhead->Used += GAP_FRAME_LENGTH;
+	UsbChief_ReadAheadPutGap(ReadAhead, 0, &header, &gap);
+}
+
+/* stages beyond the tuned depth of their pipe are left idle */
+static BOOLEAN UsbChief_ReadAheadStageActive(IN PREAD_AHEAD ReadAhead, IN PREAD_AHEAD_STAGE Stage)
+{
+	return (ULONG)(Stage - ReadAhead->Stages) % ReadAhead->Depth < ReadAhead->ActiveDepth;
+}
+
+/* OVERFLOW_POLICY_BLOCK: only post if the ring can take Stages full stages */
+static BOOLEAN UsbChief_ReadAheadMayPost(IN PREAD_AHEAD ReadAhead, IN ULONG Stages)
+{
+	if (ReadAhead->Policy != OVERFLOW_POLICY_BLOCK)
+		return TRUE;
+
+	return ReadAhead->Size - ReadAhead->Used >= GAP_FRAME_LENGTH +
+		Stages * USBCHIEF_FRAME_ALIGN_UP(sizeof(USBCHIEF_FRAME_HEADER) + ReadAhead->StageSize);
+}
+
+/* the first rule matching the stage, FILTER_MAX_RULES if none does */
+static ULONG UsbChief_FilterMatch(IN PFILTER Filter, IN PPIPE_CONTEXT PipeContext,
+				  IN PUCHAR Data, IN ULONG Length)
+{
+	PUSBCHIEF_FILTER_RULE rule;
+	ULONG rules, word, i;
+
+	rules = Filter->SlotRules[USBCHIEF_ENDPOINT_SLOT(PipeContext->EndpointAddress)];
+	for (i = 0; rules; i++, rules >>= 1) {
+		if (!(rules & 1))
+			continue;
+
+		rule = &Filter->Rules[i];
+		if (Length < rule->MinLength || Length > rule->MaxLength)
+			continue;
+		if (rule->Mask) {
+			if ((ULONG)rule->Offset + sizeof(word) > Length)
+				continue;
+			RtlCopyMemory(&word, Data + rule->Offset, sizeof(word));
+			if ((word & rule->Mask) != rule->Value)
+				continue;
+		}
+		return i;
+	}
+	return FILTER_MAX_RULES;
+}
+
+/*
+ * TRUE if the stage is dropped; called with the lock held. The first stage
+ * of a transfer decides for all of it, and the transfer state of the pipe
+ * moves on in the same step, so a later stage cannot slip in between.
+ */
+static BOOLEAN UsbChief_FilterDrop(IN PREAD_AHEAD ReadAhead, IN PPIPE_CONTEXT PipeContext,
+				   IN PUCHAR Data, IN ULONG Length, IN WORD Flags)
+{
+	PFILTER filter = &ReadAhead->Filter;
+	ULONG pipe = 1UL << PipeContext->Index;
+	ULONG rule;
+
+	filter->Stats.Frames++;
+
+	if (ReadAhead->OpenTransfers & pipe) {
+		if (Flags & USBCHIEF_FRAME_END_OF_TRANSFER)
+			ReadAhead->OpenTransfers &= ~pipe;
+		return FALSE;
+	}
+
+	if (!(ReadAhead->DroppedTransfers & pipe)) {
+		rule = UsbChief_FilterMatch(filter, PipeContext, Data, Length);
+		if (rule == FILTER_MAX_RULES) {
+			if (!(Flags & USBCHIEF_FRAME_END_OF_TRANSFER))
+				ReadAhead->OpenTransfers |= pipe;
+			return FALSE;
+		}
+		filter->Stats.Matches[rule]++;
+		filter->Stats.Transfers++;
+		ReadAhead->DroppedTransfers |= pipe;
+	}
+
+	if (Flags & USBCHIEF_FRAME_END_OF_TRANSFER)
+		ReadAhead->DroppedTransfers &= ~pipe;
+	filter->Stats.Filtered++;
+	filter->Stats.BytesSaved += USBCHIEF_FRAME_ALIGN_UP(sizeof(USBCHIEF_FRAME_HEADER) + Length);
+	return TRUE;
+}
+
+static VOID UsbChief_ReadAheadStore(IN PREAD_AHEAD ReadAhead, IN PPIPE_CONTEXT PipeContext,
+				    IN PUCHAR Data, IN ULONG Length, IN WORD Flags)
+{
+	USBCHIEF_FRAME_HEADER header;
+	ULONG frameLength, needed, crc;
+	ULONGLONG now;
+	BOOLEAN filtered = FALSE, drop = FALSE;
+
+	/*
+	 * Filtered before the checksum, dropped stages cost nothing more. A
+	 * transfer being dropped is followed to its end even if the filter
+	 * was cleared meanwhile.
+	 */
+	if (ReadAhead->Filter.Count || ReadAhead->DroppedTransfers) {
+		WdfSpinLockAcquire(ReadAhead->Lock);
+		filtered = ReadAhead->Filter.Count || ReadAhead->DroppedTransfers;
+		if (filtered)
+			drop = UsbChief_FilterDrop(ReadAhead, PipeContext, Data, Length, Flags);
+		WdfSpinLockRelease(ReadAhead->Lock);
+		if (drop)
+			return;
+	}
+
+	frameLength = USBCHIEF_FRAME_ALIGN_UP(sizeof(header) + Length);
+	crc = UsbChief_Crc32c(Data, Length);
+
+	WdfSpinLockAcquire(ReadAhead->Lock);
+
+	/* UsbChief_FilterDrop already did this for a filtered stage */
+	if (!filtered) {
+		if (Flags & USBCHIEF_FRAME_END_OF_TRANSFER)
+			ReadAhead->OpenTransfers &= ~(1UL << PipeContext->Index);
+		else
+			ReadAhead->OpenTransfers |= 1UL << PipeContext->Index;
+	}
+
+	needed = frameLength + (ReadAhead->GapPending ? GAP_FRAME_LENGTH : 0);
+
+	if (ReadAhead->Size - ReadAhead->Used < needed &&
+	    ReadAhead->Policy == OVERFLOW_POLICY_DROP_OLDEST)
+		UsbChief_ReadAheadDropOldest(ReadAhead, needed);
+
+	if (ReadAhead->Size - ReadAhead->Used < needed) {
+		now = KeQueryPerformanceCounter(NULL).QuadPart;
+		UsbChief_ReadAheadNoteGap(ReadAhead, now, now, Length, USBCHIEF_GAP_OVERFLOW);
+		WdfSpinLockRelease(ReadAhead->Lock);
+		return;
+	}
+
+	/* sequence numbers are taken under the lock so they follow ring order */
+	if (ReadAhead->GapPending) {
+		UsbChief_InitFrameHeader(ReadAhead->DeviceContext, NULL, &header, 0, 0);
+		UsbChief_ReadAheadPutGap(ReadAhead, ReadAhead->Used, &header, &ReadAhead->Gap);
+		ReadAhead->Used += GAP_FRAME_LENGTH;
+		ReadAhead->GapPending = FALSE;
+	}
+
+	UsbChief_InitFrameHeader(ReadAhead->DeviceContext, PipeContext, &header, Length,
+				 Flags | USBCHIEF_FRAME_CRC32C);
+	header.Crc32c = crc;
+
+	UsbChief_RingAppend(ReadAhead, &header, sizeof(header));
+	UsbChief_RingAppend(ReadAhead, Data, Length);
+	UsbChief_RingAppend(ReadAhead, NULL, frameLength - sizeof(header) - Length);
+
+	if (ReadAhead->Used > ReadAhead->HighWater)
+		ReadAhead->HighWater = ReadAhead->Used;
+	ReadAhead->Frames++;
+	ReadAhead->Bytes += Length;
+
+	WdfSpinLockRelease(ReadAhead->Lock);
+}
+
+/*
+ * Move buffered data into Request. Returns STATUS_PENDING if nothing could
+ * be handed out, e.g. because only empty frames were buffered for a raw
+ * read.
+ */
+static NTSTATUS UsbChief_ReadAheadCopy(IN PREAD_AHEAD ReadAhead, IN WDFREQUEST Request,
+				       OUT PULONG Copied)
+{
+	USBCHIEF_FRAME_HEADER header;
+	NTSTATUS status;
+	PUCHAR buffer;
+	size_t length;
+	ULONG frameLength, chunk;
+	BOOLEAN framed;
+
+	*Copied = 0;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, 1, &buffer, &length);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	framed = (GetFileContext(WdfRequestGetFileObject(Request))->ReadMode & READ_MODE_FRAMED) != 0;
+
+	while (ReadAhead->Used) {
+		UsbChief_RingPeek(ReadAhead, 0, &header, sizeof(header));
+		frameLength = USBCHIEF_FRAME_ALIGN_UP(sizeof(header) + header.Length);
+
+		if (!framed && (header.Flags & USBCHIEF_FRAME_GAP)) {
+			UsbChief_RingConsume(ReadAhead, frameLength);
+			continue;
+		}
+
+		if (!framed) {
+			chunk = min(header.Length - ReadAhead->FrameConsumed,
+				    (ULONG)length - *Copied);
+			UsbChief_RingPeek(ReadAhead, sizeof(header) + ReadAhead->FrameConsumed,
+					  buffer + *Copied, chunk);
+			*Copied += chunk;
+			ReadAhead->FrameConsumed += chunk;
+
+			if (ReadAhead->FrameConsumed < header.Length)
+				break;
+			UsbChief_RingConsume(ReadAhead, frameLength);
+			continue;
+		}
+
+		if (ReadAhead->FrameConsumed) {
+			/* partly handed out by a raw read, the rest is lost */
+			UsbChief_RingConsume(ReadAhead, frameLength);
+			continue;
+		}
+
+		if (frameLength > length - *Copied) {
+			if (!*Copied)
+				return STATUS_BUFFER_TOO_SMALL;
+			break;
+		}
+
+		UsbChief_RingPeek(ReadAhead, 0, buffer + *Copied, frameLength);
+		*Copied += frameLength;
+		UsbChief_RingConsume(ReadAhead, frameLength);
+	}
+	return *Copied ? STATUS_SUCCESS : STATUS_PENDING;
+}
+
+static VOID UsbChief_ReadAheadDrain(IN PREAD_AHEAD ReadAhead)
+{
+	WDFREQUEST request;
+	NTSTATUS status;
+	ULONG copied;
+
+	for (;;) {
+		WdfSpinLockAcquire(ReadAhead->Lock);
+
+		if (!ReadAhead->Used ||
+		    !NT_SUCCESS(WdfIoQueueRetrieveNextRequest(ReadAhead->PendingReads, &request))) {
+			WdfSpinLockRelease(ReadAhead->Lock);
+			return;
+		}
+
+		status = UsbChief_ReadAheadCopy(ReadAhead, request, &copied);
+		WdfSpinLockRelease(ReadAhead->Lock);
+
+		if (status == STATUS_PENDING) {
+			if (!NT_SUCCESS(WdfRequestRequeue(request)))
+				UsbChief_CompleteRead(ReadAhead->DeviceContext, request, STATUS_SUCCESS, 0);
+			return;
+		}
+
+		UsbChief_DbgPrint(DEBUG_RW, ("read-ahead: completing read with %d bytes\n", copied));
+		UsbChief_CompleteRead(ReadAhead->DeviceContext, request, status, copied);
+	}
+}
+
+/* complete every parked read with Status, e.g. when no stage will fill them */
+static VOID UsbChief_ReadAheadFailReads(IN PREAD_AHEAD ReadAhead, IN NTSTATUS Status)
+{
+	WDFREQUEST request;
+
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(ReadAhead->PendingReads, &request)))
+		UsbChief_CompleteRead(ReadAhead->DeviceContext, request, Status, 0);
+}
+
+static VOID UsbChief_ReadAheadIdle(IN PREAD_AHEAD ReadAhead, IN PREAD_AHEAD_STAGE Stage)
+{
+	WdfSpinLockAcquire(ReadAhead->Lock);
+	Stage->Posted = FALSE;
+	Stage->Sent = FALSE;
+	if (!--ReadAhead->Posted)
+		KeSetEvent(&ReadAhead->Idle, IO_NO_INCREMENT, FALSE);
+	WdfSpinLockRelease(ReadAhead->Lock);
+}
+
+static VOID UsbChief_ReadAheadPost(IN PREAD_AHEAD ReadAhead, IN PREAD_AHEAD_STAGE Stage)
+{
+	WDF_REQUEST_REUSE_PARAMS reuseParams;
+	WDFMEMORY_OFFSET offset;
+	NTSTATUS status;
+	BOOLEAN send;
+
+	WDF_REQUEST_REUSE_PARAMS_INIT(&reuseParams, WDF_REQUEST_REUSE_NO_FLAGS, STATUS_SUCCESS);
+	WdfRequestReuse(Stage->Request, &reuseParams);
+
+	Stage->Length = Stage->Size;
+	offset.BufferOffset = 0;
+	offset.BufferLength = Stage->Length;
+
+	status = WdfUsbTargetPipeFormatRequestForRead(Stage->PipeContext->Pipe, Stage->Request,
+						      Stage->Memory, &offset);
+	if (NT_SUCCESS(status)) {
+		WdfRequestSetCompletionRoutine(Stage->Request, UsbChief_ReadAheadCompletion, Stage);
+
+		Stage->PostTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
+		/* once Stopping is set nothing new reaches the pipe, see Quiesce */
+		WdfSpinLockAcquire(ReadAhead->Lock);
+		send = !ReadAhead->Stopping;
+		Stage->Sent = send;
+		WdfSpinLockRelease(ReadAhead->Lock);
+
+		if (send && WdfRequestSend(Stage->Request,
+					   WdfUsbTargetPipeGetIoTarget(Stage->PipeContext->Pipe),
+					   WDF_NO_SEND_OPTIONS))
+			return;
+
+		status = send ? WdfRequestGetStatus(Stage->Request) : STATUS_CANCELLED;
+	}
+	if (status != STATUS_CANCELLED)
+		UsbChief_DbgPrint(0, ("read-ahead: failed to post stage %x\n", status));
+	UsbChief_ReadAheadIdle(ReadAhead, Stage);
+}
+
+/* post every stage that is not in flight and the overflow policy allows */
+static VOID UsbChief_ReadAheadKick(IN PREAD_AHEAD ReadAhead)
+{
+	PREAD_AHEAD_STAGE stage;
+	ULONGLONG now;
+	ULONG i;
+
+	for (i = 0; i < ReadAhead->StageCount; i++) {
+		stage = &ReadAhead->Stages[i];
+
+		WdfSpinLockAcquire(ReadAhead->Lock);
+		if (ReadAhead->Stopping || stage->Posted ||
+		    !UsbChief_ReadAheadStageActive(ReadAhead, stage)) {
+			WdfSpinLockRelease(ReadAhead->Lock);
+			continue;
+		}
+		if (!UsbChief_ReadAheadMayPost(ReadAhead, ReadAhead->Posted + 1)) {
+			WdfSpinLockRelease(ReadAhead->Lock);
+			break;
+		}
+		if (ReadAhead->BlockedSince) {
+			now = KeQueryPerformanceCounter(NULL).QuadPart;
+			UsbChief_ReadAheadNoteGap(ReadAhead, ReadAhead->BlockedSince, now, 0,
+						  USBCHIEF_GAP_BLOCKED);
+			ReadAhead->BlockedTime += now - ReadAhead->BlockedSince;
+			ReadAhead->BlockedSince = 0;
+		}
+		stage->Posted = TRUE;
+		if (!ReadAhead->Posted++)
+			KeClearEvent(&ReadAhead->Idle);
+		WdfSpinLockRelease(ReadAhead->Lock);
+
+		UsbChief_ReadAheadPost(ReadAhead, stage);
+	}
+}
+
+static VOID UsbChief_ReadAheadCompletion(IN WDFREQUEST Request, IN WDFIOTARGET Target,
+					 PWDF_REQUEST_COMPLETION_PARAMS CompletionParams,
+					 IN WDFCONTEXT Context)
+{
+	PREAD_AHEAD_STAGE stage = (PREAD_AHEAD_STAGE)Context;
+	PREAD_AHEAD readAhead = stage->ReadAhead;
+	PAUTOTUNE autotune = &readAhead->Autotune;
+	NTSTATUS status;
+	ULONGLONG now = 0;
+	ULONG bytesRead = 0;
+	BOOLEAN repost;
+
+	UNREFERENCED_PARAMETER(Request);
+
+	status = CompletionParams->IoStatus.Status;
+
+	if (NT_SUCCESS(status)) {
+		now = KeQueryPerformanceCounter(NULL).QuadPart;
+		bytesRead = (ULONG)CompletionParams->Parameters.Usb.Completion->Parameters.PipeRead.Length;
+	}
+	UsbChief_Trace(readAhead->DeviceContext, TRACE_STAGE, stage->PipeContext->EndpointAddress,
+		       stage->PostTime, status, 0, stage->Length, bytesRead, NULL, 0);
+
+	if (NT_SUCCESS(status)) {
+		UsbChief_CountStage(readAhead->DeviceContext, stage->PipeContext, stage->Length,
+				    bytesRead, now - stage->PostTime);
+		UsbChief_ReadAheadStore(readAhead, stage->PipeContext, stage->Buffer, bytesRead,
+					bytesRead < stage->Length ? USBCHIEF_FRAME_END_OF_TRANSFER : 0);
+		UsbChief_ReadAheadDrain(readAhead);
+	} else if (status != STATUS_CANCELLED) {
+		/*
+		 * The stage stays idle until the pipe is reset and a read kicks it,
+		 * so parked reads get the error, as a direct read would.
+		 */
+		InterlockedIncrement(&stage->PipeContext->Stats.Errors);
+		UsbChief_QueuePassiveLevelCallback(WdfIoTargetGetDevice(Target), stage->PipeContext);
+		UsbChief_ReadAheadFailReads(readAhead, status);
+	}
+
+	WdfSpinLockAcquire(readAhead->Lock);
+	stage->Sent = FALSE;
+	if (NT_SUCCESS(status)) {
+		autotune->WindowStages++;
+		autotune->WindowBytes += bytesRead;
+		autotune->WindowLatency += now - stage->PostTime;
+		if (bytesRead < stage->Length)
+			autotune->WindowShort++;
+	}
+	repost = NT_SUCCESS(status) && !readAhead->Stopping &&
+		UsbChief_ReadAheadStageActive(readAhead, stage);
+	if (repost && !UsbChief_ReadAheadMayPost(readAhead, readAhead->Posted)) {
+		/* blocked until a read makes room; remember when the pipe went idle */
+		repost = FALSE;
+		if (readAhead->Posted == 1)
+			readAhead->BlockedSince = KeQueryPerformanceCounter(NULL).QuadPart;
+	}
+	WdfSpinLockRelease(readAhead->Lock);
+
+	if (repost)
+		UsbChief_ReadAheadPost(readAhead, stage);
+	else
+		UsbChief_ReadAheadIdle(readAhead, stage);
+}
+
+static VOID UsbChief_ReadAheadRead(IN PREAD_AHEAD ReadAhead, IN WDFREQUEST Request)
+{
+	NTSTATUS status;
+
+	if (ReadAhead->Detached || ReadAhead->DeviceContext->Removed) {
+		UsbChief_CompleteRead(ReadAhead->DeviceContext, Request,
+				      ReadAhead->Detached ? STATUS_INVALID_DEVICE_STATE :
+				      STATUS_DEVICE_REMOVED, 0);
+		return;
+	}
+
+	status = WdfRequestForwardToIoQueue(Request, ReadAhead->PendingReads);
+	if (!NT_SUCCESS(status)) {
+		UsbChief_CompleteRead(ReadAhead->DeviceContext, Request, status, 0);
+		return;
+	}
+
+	/* parked just after a surprise removal failed the others */
+	if (ReadAhead->DeviceContext->Removed) {
+		UsbChief_ReadAheadFailReads(ReadAhead, STATUS_DEVICE_REMOVED);
+		return;
+	}
+
+	UsbChief_ReadAheadDrain(ReadAhead);
+	UsbChief_ReadAheadKick(ReadAhead);
+}
+
+/*
+ * Stop reposting and wait until no stage is in flight. A completion routine
+ * may still be about to repost when Stopping is set, so sent stages are
+ * cancelled again until the ring goes idle. Sent is checked under the lock
+ * and the request held while it is cancelled.
+ */
+static VOID UsbChief_ReadAheadQuiesce(IN PREAD_AHEAD ReadAhead)
+{
+	LARGE_INTEGER timeout;
+	WDFREQUEST request;
+	ULONG i;
+
+	WdfSpinLockAcquire(ReadAhead->Lock);
+	ReadAhead->Stopping = TRUE;
+	WdfSpinLockRelease(ReadAhead->Lock);
+
+	timeout.QuadPart = WDF_REL_TIMEOUT_IN_MS(10);
+
+	for (;;) {
+		for (i = 0; i < ReadAhead->StageCount; i++) {
+			WdfSpinLockAcquire(ReadAhead->Lock);
+			request = ReadAhead->Stages[i].Sent ? ReadAhead->Stages[i].Request : NULL;
+			if (request)
+				WdfObjectReference(request);
+			WdfSpinLockRelease(ReadAhead->Lock);
+
+			if (request) {
+				WdfRequestCancelSentRequest(request);
+				WdfObjectDereference(request);
+			}
+		}
+		if (KeWaitForSingleObject(&ReadAhead->Idle, Executive, KernelMode,
+					  FALSE, &timeout) != STATUS_TIMEOUT)
+			break;
+	}
+}
+
+/*
+ * Give every stage its size: the requested stage size in whole packets of
+ * the stage's pipe. Fails if a stage has no IN pipe to read from.
+ */
+static BOOLEAN UsbChief_ReadAheadSizeStages(IN PREAD_AHEAD ReadAhead)
+{
+	PREAD_AHEAD_STAGE stage;
+	PPIPE_CONTEXT pipeContext;
+	ULONG i, size;
+
+	ReadAhead->StageSize = 0;
+
+	for (i = 0; i < ReadAhead->StageCount; i++) {
+		stage = &ReadAhead->Stages[i];
+		pipeContext = stage->PipeContext;
+
+		if (!pipeContext || !pipeContext->Pipe || !pipeContext->In)
+			return FALSE;
+
+		size = min(ReadAhead->RequestedStageSize, pipeContext->StageSize);
+		if (pipeContext->MaximumPacketSize)
+			size -= size % pipeContext->MaximumPacketSize;
+		if (!size)
+			return FALSE;
+
+		stage->Size = size;
+		if (size > ReadAhead->StageSize)
+			ReadAhead->StageSize = size;
+	}
+	return TRUE;
+}
+
+/*
+ * Restart a quiesced read-ahead after a setting switch. A handle's own
+ * read-ahead moves to PipeContext; a capture stays on its pipe indices.
+ * Buffered frames are kept and stage sizes are worked out again for the
+ * new pipes. If a pipe is gone the ring stays stopped, pending reads are
+ * failed and so are later ones.
+ */
+static VOID UsbChief_ReadAheadResume(IN PREAD_AHEAD ReadAhead, IN PPIPE_CONTEXT PipeContext)
+{
+	BOOLEAN usable;
+	ULONG i;
+
+	if (!ReadAhead->PipeMask) {
+		for (i = 0; i < ReadAhead->StageCount; i++)
+			ReadAhead->Stages[i].PipeContext = PipeContext;
+	}
+
+	WdfSpinLockAcquire(ReadAhead->Lock);
+	usable = UsbChief_ReadAheadSizeStages(ReadAhead);
+	ReadAhead->Detached = !usable;
+	/* transfers under way were cancelled with the old pipes */
+	ReadAhead->OpenTransfers = 0;
+	ReadAhead->DroppedTransfers = 0;
+	if (usable)
+		ReadAhead->Stopping = FALSE;
+	WdfSpinLockRelease(ReadAhead->Lock);
+
+	if (!usable) {
+		UsbChief_DbgPrint(0, ("read-ahead: no pipe to resume on\n"));
+		UsbChief_ReadAheadFailReads(ReadAhead, STATUS_INVALID_DEVICE_STATE);
+		return;
+	}
+
+	UsbChief_DbgPrint(DEBUG_RW, ("read-ahead: resumed with %d byte stages\n", ReadAhead->StageSize));
+	UsbChief_ReadAheadKick(ReadAhead);
+}
+
+static VOID UsbChief_ReadAheadDestroy(IN PREAD_AHEAD ReadAhead)
+{
+	ULONG i;
+
+	if (ReadAhead->Autotune.SetLock) {
+		WdfWaitLockAcquire(ReadAhead->Autotune.SetLock, NULL);
+		if (ReadAhead->Autotune.Timer)
+			WdfTimerStop(ReadAhead->Autotune.Timer, TRUE);
+		WdfWaitLockRelease(ReadAhead->Autotune.SetLock);
+	}
+
+	UsbChief_ReadAheadQuiesce(ReadAhead);
+
+	if (ReadAhead->PendingReads) {
+		WdfIoQueuePurgeSynchronously(ReadAhead->PendingReads);
+		WdfObjectDelete(ReadAhead->PendingReads);
+	}
+
+	for (i = 0; i < READ_AHEAD_MAX_STAGES; i++) {
+		if (ReadAhead->Stages[i].Request)
+			WdfObjectDelete(ReadAhead->Stages[i].Request);
+	}
+
+	InterlockedExchangeAdd(&ReadAhead->DeviceContext->ReadAheadBytes, -(LONG)ReadAhead->Budget);
+	ReadAhead->Budget = 0;
+	/* the ring and ReadAhead itself belong to the file object */
+}
+
+/*
+ * Start read-ahead on the handle's pipe, or with a PipeMask on all those
+ * IN pipes at once. Stages are laid out pipe after pipe, Depth each.
+ */
+/* Gap, if not NULL, is put in front of the first frame */
+static NTSTATUS UsbChief_ReadAheadCreate(IN WDFFILEOBJECT FileObject, IN ULONG PipeMask,
+					 IN PUSBCHIEF_READ_AHEAD_PARAMS Params,
+					 IN PUSBCHIEF_GAP_RECORD Gap)
+{
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_IO_QUEUE_CONFIG queueConfig;
+	PDEVICE_CONTEXT deviceContext;
+	PFILE_CONTEXT fileContext;
+	PPIPE_CONTEXT pipes[USBCHIEF_MAX_PIPES];
+	PREAD_AHEAD readAhead;
+	PREAD_AHEAD_STAGE stage;
+	WDFDEVICE device;
+	WDFMEMORY memory;
+	NTSTATUS status;
+	ULONG size, stageSize, depth, count, budget, i;
+
+	fileContext = GetFileContext(FileObject);
+	device = WdfFileObjectGetDevice(FileObject);
+	deviceContext = GetDeviceContext(device);
+
+	if (fileContext->ReadAhead)
+		return STATUS_DEVICE_BUSY;
+
+	count = 0;
+	if (!PipeMask) {
+		if (!fileContext->Pipe || !fileContext->PipeContext->In)
+			return STATUS_INVALID_DEVICE_REQUEST;
+		pipes[count++] = fileContext->PipeContext;
+	} else {
+		for (i = 0; i < USBCHIEF_MAX_PIPES; i++) {
+			if (!(PipeMask & (1UL << i)))
+				continue;
+			if (i >= deviceContext->NumberConfiguredPipes || !deviceContext->Pipes[i].In)
+				return STATUS_INVALID_PARAMETER;
+			pipes[count++] = &deviceContext->Pipes[i];
+		}
+	}
+
+	size = Params->Size ? Params->Size : READ_AHEAD_DEFAULT_SIZE;
+	stageSize = Params->StageSize ? Params->StageSize : MAX_TRANSFER_SIZE;
+	depth = Params->Depth ? Params->Depth : READ_AHEAD_DEFAULT_DEPTH;
+
+	size &= ~(USBCHIEF_FRAME_ALIGN - 1);
+	if (stageSize > MAX_TRANSFER_SIZE)
+		stageSize = MAX_TRANSFER_SIZE;
+
+	if (depth > READ_AHEAD_MAX_DEPTH || count * depth > READ_AHEAD_MAX_STAGES ||
+	    size > READ_AHEAD_MAX_SIZE ||
+	    size < 2 * USBCHIEF_FRAME_ALIGN_UP(sizeof(USBCHIEF_FRAME_HEADER) + stageSize))
+		return STATUS_INVALID_PARAMETER;
+
+	budget = size + count * depth * MAX_TRANSFER_SIZE;
+	if ((ULONG)InterlockedExchangeAdd(&deviceContext->ReadAheadBytes, budget) + budget >
+	    READ_AHEAD_DEVICE_BUDGET) {
+		status = STATUS_INSUFFICIENT_RESOURCES;
+		goto Release;
+	}
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = FileObject;
+
+	status = WdfMemoryCreate(&attributes, NonPagedPool, POOL_TAG, sizeof(*readAhead),
+				 &memory, (PVOID *)&readAhead);
+	if (!NT_SUCCESS(status))
+		goto Release;
+
+	RtlZeroMemory(readAhead, sizeof(*readAhead));
+
+	readAhead->DeviceContext = deviceContext;
+	readAhead->PipeMask = PipeMask;
+	readAhead->RequestedStageSize = stageSize;
+	readAhead->Depth = depth;
+	readAhead->ActiveDepth = depth;
+	readAhead->StageCount = count * depth;
+
+	for (i = 0; i < readAhead->StageCount; i++)
+		readAhead->Stages[i].PipeContext = pipes[i / depth];
+
+	if (!UsbChief_ReadAheadSizeStages(readAhead)) {
+		status = STATUS_INVALID_PARAMETER;
+		goto Release;
+	}
+
+	status = WdfMemoryCreate(&attributes, NonPagedPool, POOL_TAG, size,
+				 &memory, (PVOID *)&readAhead->Ring);
+	if (!NT_SUCCESS(status))
+		goto Release;
+
+	status = WdfSpinLockCreate(&attributes, &readAhead->Lock);
+	if (!NT_SUCCESS(status))
+		goto Release;
+
+	status = WdfWaitLockCreate(&attributes, &readAhead->Autotune.SetLock);
+	if (!NT_SUCCESS(status))
+		goto Release;
+
+	/* from here on Destroy gives the budget back */
+	readAhead->Budget = budget;
+	readAhead->Size = size;
+	KeInitializeEvent(&readAhead->Idle, NotificationEvent, TRUE);
+
+	WDF_IO_QUEUE_CONFIG_INIT(&queueConfig, WdfIoQueueDispatchManual);
+	queueConfig.PowerManaged = WdfFalse;
+
+	status = WdfIoQueueCreate(device, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES,
+				  &readAhead->PendingReads);
+	if (!NT_SUCCESS(status))
+		goto Error;
+
+	for (i = 0; i < readAhead->StageCount; i++) {
+		stage = &readAhead->Stages[i];
+		stage->ReadAhead = readAhead;
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+		attributes.ParentObject = device;
+
+		status = WdfRequestCreate(&attributes,
+					  WdfUsbTargetPipeGetIoTarget(stage->PipeContext->Pipe),
+					  &stage->Request);
+		if (!NT_SUCCESS(status))
+			goto Error;
+
+		attributes.ParentObject = stage->Request;
+
+		status = WdfMemoryCreate(&attributes, NonPagedPool, POOL_TAG, MAX_TRANSFER_SIZE,
+					 &stage->Memory, (PVOID *)&stage->Buffer);
+		if (!NT_SUCCESS(status))
+			goto Error;
+	}
+
+	UsbChief_DbgPrint(DEBUG_RW, ("read-ahead: %d bytes, %d pipe(s) x %d x %d byte stages\n",
+				     size, count, depth, readAhead->StageSize));
+
+	if (Gap) {
+		readAhead->Gap = *Gap;
+		readAhead->GapPending = TRUE;
+	}
+
+	fileContext->ReadAhead = readAhead;
+	UsbChief_ReadAheadKick(readAhead);
+	return STATUS_SUCCESS;
+
+Error:
+	UsbChief_ReadAheadDestroy(readAhead);
+	return status;
+
+Release:
+	InterlockedExchangeAdd(&deviceContext->ReadAheadBytes, -(LONG)budget);
+	return status;
+}
+
+static VOID UsbChief_ReadAheadGetStats(IN PREAD_AHEAD ReadAhead,
+				       OUT PUSBCHIEF_READ_AHEAD_STATS Stats)
+{
+	WdfSpinLockAcquire(ReadAhead->Lock);
+	Stats->Size = ReadAhead->Size;
+	Stats->Used = ReadAhead->Used;
+	Stats->HighWater = ReadAhead->HighWater;
+	Stats->Overflows = ReadAhead->Overflows;
+	Stats->OverflowBytes = ReadAhead->OverflowBytes;
+	Stats->Frames = ReadAhead->Frames;
+	Stats->Bytes = ReadAhead->Bytes;
+	Stats->Policy = ReadAhead->Policy;
+	Stats->Gaps = ReadAhead->Gaps;
+	Stats->BlockedTime = ReadAhead->BlockedTime;
+	WdfSpinLockRelease(ReadAhead->Lock);
+}
 
-	UsbChief_DbgPrint(DEBUG_RW, ("UsbChief_DispatchReadWrite - begins\n"));
+static NTSTATUS UsbChief_ReadAheadSetPolicy(IN PREAD_AHEAD ReadAhead, IN ULONG Policy)
+{
+	if (Policy > OVERFLOW_POLICY_BLOCK)
+		return STATUS_INVALID_PARAMETER;
 
-	deviceContext = GetDeviceContext(WdfIoQueueGetDevice(Queue));
-	fileContext = GetFileContext(WdfRequestGetFileObject(Request));
-	pipe = fileContext->Pipe;
+	WdfSpinLockAcquire(ReadAhead->Lock);
+	ReadAhead->Policy = Policy;
+	WdfSpinLockRelease(ReadAhead->Lock);
+
+	/* stages held back by OVERFLOW_POLICY_BLOCK may go again */
+	UsbChief_ReadAheadKick(ReadAhead);
+	return STATUS_SUCCESS;
+}
 
-	WDF_USB_PIPE_INFORMATION_INIT(&pipeInfo);
-	WdfUsbTargetPipeGetInformation(pipe, &pipeInfo);
 
-	rwContext = GetRequestContext(Request);
+static NTSTATUS UsbChief_FilterSet(IN PREAD_AHEAD ReadAhead, IN PUSBCHIEF_FILTER_RULE Rules,
+				   IN ULONG Count)
+{
+	PFILTER filter = &ReadAhead->Filter;
+	ULONG slotRules[32];
+	ULONG i, slot;
 
-	status = WdfRequestRetrieveOutputWdmMdl(Request, &requestMdl);
-	if(!NT_SUCCESS(status)){
-		UsbChief_DbgPrint(0, ("WdfRequestRetrieveOutputWdmMdl failed %x\n", status));
-		goto Exit;
+	if (Count > FILTER_MAX_RULES)
+		return STATUS_INVALID_PARAMETER;
+
+	RtlZeroMemory(slotRules, sizeof(slotRules));
+	for (i = 0; i < Count; i++) {
+		if (Rules[i].MinLength > Rules[i].MaxLength)
+			return STATUS_INVALID_PARAMETER;
+
+		if (Rules[i].EndpointAddress) {
+			slotRules[USBCHIEF_ENDPOINT_SLOT(Rules[i].EndpointAddress)] |= 1UL << i;
+			continue;
+		}
+		for (slot = 0; slot < ARRAYSIZE(slotRules); slot++)
+			slotRules[slot] |= 1UL << i;
 	}
-	virtualAddress = (ULONG_PTR) MmGetMdlVirtualAddress(requestMdl);
 
-	if (totalLength > MAX_TRANSFER_SIZE)
-		stageLength = MAX_TRANSFER_SIZE;
-	else
-		stageLength = totalLength;
+	WdfSpinLockAcquire(ReadAhead->Lock);
+	RtlZeroMemory(filter, sizeof(*filter));
+	if (Count)
+		RtlCopyMemory(filter->Rules, Rules, Count * sizeof(*Rules));
+	RtlCopyMemory(filter->SlotRules, slotRules, sizeof(slotRules));
+	filter->Count = Count;
+	WdfSpinLockRelease(ReadAhead->Lock);
+	return STATUS_SUCCESS;
+}
 
-	newMdl = IoAllocateMdl((PVOID) virtualAddress, totalLength,
-			       FALSE, FALSE, NULL);
+static VOID UsbChief_FilterGetStats(IN PREAD_AHEAD ReadAhead, OUT PUSBCHIEF_FILTER_STATS Stats)
+{
+	WdfSpinLockAcquire(ReadAhead->Lock);
+	*Stats = ReadAhead->Filter.Stats;
+	WdfSpinLockRelease(ReadAhead->Lock);
+}
 
-	if (!newMdl) {
-		UsbChief_DbgPrint(0, ("Failed to alloc mem for mdl\n"));
-		status = STATUS_INSUFFICIENT_RESOURCES;
-		goto Exit;
+/* called with the lock held; on failure the old stage size stays */
+static BOOLEAN UsbChief_AutotuneStageSize(IN PREAD_AHEAD ReadAhead, IN ULONG StageSize)
+{
+	ULONG old = ReadAhead->RequestedStageSize;
+
+	ReadAhead->RequestedStageSize = StageSize;
+	if (UsbChief_ReadAheadSizeStages(ReadAhead))
+		return TRUE;
+
+	ReadAhead->RequestedStageSize = old;
+	UsbChief_ReadAheadSizeStages(ReadAhead);
+	return FALSE;
+}
+
+/*
+ * Judge the interval that just ended and make at most one change, see
+ * USBCHIEF_AUTOTUNE_PARAMS. Intervals without completed stages are
+ * skipped, so an idle device or a stopped ring does not count against a
+ * change on trial.
+ */
+static VOID UsbChief_AutotuneTimer(IN WDFTIMER Timer)
+{
+	PREAD_AHEAD readAhead;
+	PAUTOTUNE autotune;
+	PUSBCHIEF_AUTOTUNE_PARAMS params;
+	ULONGLONG now, elapsed, throughput, latency;
+	ULONG shortRate, stageSize, decision;
+	BOOLEAN kick = FALSE;
+
+	readAhead = GetFileContext(WdfTimerGetParentObject(Timer))->ReadAhead;
+	autotune = &readAhead->Autotune;
+	params = &autotune->Params;
+	now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+	WdfSpinLockAcquire(readAhead->Lock);
+
+	elapsed = now - autotune->WindowStart;
+	if (readAhead->Stopping || !autotune->WindowStages || !elapsed)
+		goto next;
+
+	throughput = autotune->WindowBytes * autotune->Frequency / elapsed;
+	latency = autotune->WindowLatency * 1000000 / autotune->Frequency / autotune->WindowStages;
+	shortRate = autotune->WindowShort * 256 / autotune->WindowStages;
+	decision = AUTOTUNE_NONE;
+
+	if (autotune->Trial != AUTOTUNE_NONE) {
+		if (throughput * 16 < autotune->Baseline * 17) {
+			UsbChief_AutotuneStageSize(readAhead, autotune->UndoStageSize);
+			readAhead->ActiveDepth = autotune->UndoDepth;
+			autotune->Hold = AUTOTUNE_HOLD_INTERVALS;
+			autotune->State.Reverts++;
+			decision = AUTOTUNE_REVERT;
+		} else {
+			decision = AUTOTUNE_KEEP;
+		}
+		autotune->Trial = AUTOTUNE_NONE;
+	} else if (latency > params->LatencyTarget) {
+		stageSize = max(readAhead->RequestedStageSize / 2, params->MinStageSize);
+		if (stageSize < readAhead->RequestedStageSize &&
+		    UsbChief_AutotuneStageSize(readAhead, stageSize)) {
+			decision = AUTOTUNE_SHRINK_STAGE;
+		} else if (readAhead->ActiveDepth > params->MinDepth) {
+			readAhead->ActiveDepth--;
+			decision = AUTOTUNE_SHRINK_DEPTH;
+		}
+	} else if (autotune->Hold) {
+		autotune->Hold--;
+	} else if (latency < params->LatencyTarget / 2 && shortRate < 32) {
+		autotune->UndoStageSize = readAhead->RequestedStageSize;
+		autotune->UndoDepth = readAhead->ActiveDepth;
+		autotune->Baseline = throughput;
+
+		stageSize = min(readAhead->RequestedStageSize * 2, params->MaxStageSize);
+		if (stageSize > readAhead->RequestedStageSize &&
+		    UsbChief_AutotuneStageSize(readAhead, stageSize)) {
+			decision = AUTOTUNE_GROW_STAGE;
+		} else if (readAhead->ActiveDepth < params->MaxDepth) {
+			readAhead->ActiveDepth++;
+			decision = AUTOTUNE_GROW_DEPTH;
+			kick = TRUE;
+		}
+		autotune->Trial = decision;
 	}
 
-	IoBuildPartialMdl(requestMdl, newMdl, (PVOID)virtualAddress,
-			  stageLength);
+	if (decision != AUTOTUNE_NONE && decision != AUTOTUNE_KEEP && decision != AUTOTUNE_REVERT)
+		autotune->State.Changes++;
+
+	autotune->State.Decision = decision;
+	autotune->State.Throughput = throughput;
+	autotune->State.Latency = (ULONG)latency;
+	autotune->State.ShortRate = shortRate;
+
+	if (decision != AUTOTUNE_NONE)
+		UsbChief_DbgPrint(DEBUG_RW, ("autotune: %d, %I64d B/s, %d us, short %d/256 -> %d x %d\n",
+					     decision, throughput, (ULONG)latency, shortRate,
+					     readAhead->ActiveDepth, readAhead->StageSize));
+next:
+	autotune->WindowStart = now;
+	autotune->WindowBytes = 0;
+	autotune->WindowLatency = 0;
+	autotune->WindowStages = 0;
+	autotune->WindowShort = 0;
+	WdfSpinLockRelease(readAhead->Lock);
+
+	if (kick)
+		UsbChief_ReadAheadKick(readAhead);
+}
 
-	WDF_OBJECT_ATTRIBUTES_INIT(&objectAttribs);
-	objectAttribs.ParentObject = Request;
+static NTSTATUS UsbChief_AutotuneSet(IN WDFFILEOBJECT FileObject,
+				     IN PUSBCHIEF_AUTOTUNE_PARAMS Params)
+{
+	USBCHIEF_AUTOTUNE_PARAMS params = *Params;
+	WDF_OBJECT_ATTRIBUTES attributes;
+	WDF_TIMER_CONFIG timerConfig;
+	LARGE_INTEGER frequency;
+	PREAD_AHEAD readAhead;
+	PAUTOTUNE autotune;
+	WDFTIMER timer;
+	NTSTATUS status = STATUS_SUCCESS;
+
+	readAhead = GetFileContext(FileObject)->ReadAhead;
+	if (!readAhead)
+		return STATUS_INVALID_DEVICE_REQUEST;
+	autotune = &readAhead->Autotune;
+
+	if (!params.MinStageSize)
+		params.MinStageSize = AUTOTUNE_DEFAULT_MIN_STAGE;
+	if (!params.MaxStageSize)
+		params.MaxStageSize = MAX_TRANSFER_SIZE;
+	if (!params.MinDepth)
+		params.MinDepth = 1;
+	if (!params.MaxDepth)
+		params.MaxDepth = readAhead->Depth;
+	if (!params.Interval)
+		params.Interval = AUTOTUNE_DEFAULT_INTERVAL;
+	if (!params.LatencyTarget)
+		params.LatencyTarget = AUTOTUNE_DEFAULT_LATENCY;
+
+	/* every stage must still fit the ring twice over */
+	params.MaxStageSize = min(params.MaxStageSize, MAX_TRANSFER_SIZE);
+	params.MaxStageSize = min(params.MaxStageSize,
+				  readAhead->Size / 2 - sizeof(USBCHIEF_FRAME_HEADER));
+
+	if (params.Enable && (params.MinStageSize > params.MaxStageSize ||
+			      params.MinDepth > params.MaxDepth ||
+			      params.MaxDepth > readAhead->Depth ||
+			      params.Interval < AUTOTUNE_MIN_INTERVAL))
+		return STATUS_INVALID_PARAMETER;
+
+	/* the timer is swapped outside readAhead->Lock, callers must not interleave */
+	WdfWaitLockAcquire(autotune->SetLock, NULL);
+
+	/* a new interval needs a new periodic timer */
+	if (autotune->Timer) {
+		WdfTimerStop(autotune->Timer, TRUE);
+		WdfObjectDelete(autotune->Timer);
+		autotune->Timer = NULL;
+	}
 
-	status = WdfMemoryCreate(&objectAttribs,
-				 NonPagedPool,
-				 POOL_TAG,
-				 sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-				 &urbMemory,
-				 (PVOID*) &urb);
+	WdfSpinLockAcquire(readAhead->Lock);
+	autotune->Enabled = FALSE;
+	autotune->State.Enabled = FALSE;
+	WdfSpinLockRelease(readAhead->Lock);
 
-	if (!NT_SUCCESS(status)) {
-		UsbChief_DbgPrint(0, ("Failed to alloc mem for urb\n"));
-		status = STATUS_INSUFFICIENT_RESOURCES;
-		goto Exit;
+	if (!params.Enable)
+		goto out;
+
+	WDF_TIMER_CONFIG_INIT_PERIODIC(&timerConfig, UsbChief_AutotuneTimer, params.Interval);
+	timerConfig.AutomaticSerialization = FALSE;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attributes);
+	attributes.ParentObject = FileObject;
+
+	status = WdfTimerCreate(&timerConfig, &attributes, &timer);
+	if (!NT_SUCCESS(status))
+		goto out;
+
+	KeQueryPerformanceCounter(&frequency);
+
+	WdfSpinLockAcquire(readAhead->Lock);
+	autotune->Timer = timer;
+	autotune->Params = params;
+	autotune->Frequency = frequency.QuadPart;
+	autotune->Enabled = TRUE;
+	autotune->State.Enabled = TRUE;
+	autotune->Trial = AUTOTUNE_NONE;
+	autotune->Hold = 0;
+	autotune->WindowStart = KeQueryPerformanceCounter(NULL).QuadPart;
+	autotune->WindowBytes = 0;
+	autotune->WindowLatency = 0;
+	autotune->WindowStages = 0;
+	autotune->WindowShort = 0;
+
+	/* start from the current setup, moved into the limits */
+	if (readAhead->RequestedStageSize < params.MinStageSize)
+		UsbChief_AutotuneStageSize(readAhead, params.MinStageSize);
+	else if (readAhead->RequestedStageSize > params.MaxStageSize)
+		UsbChief_AutotuneStageSize(readAhead, params.MaxStageSize);
+	readAhead->ActiveDepth = max(min(readAhead->ActiveDepth, params.MaxDepth), params.MinDepth);
+	WdfSpinLockRelease(readAhead->Lock);
+
+	UsbChief_ReadAheadKick(readAhead);
+	WdfTimerStart(timer, WDF_REL_TIMEOUT_IN_MS(params.Interval));
+out:
+	WdfWaitLockRelease(autotune->SetLock);
+	return status;
+}
+
+static VOID UsbChief_AutotuneGet(IN PREAD_AHEAD ReadAhead, OUT PUSBCHIEF_AUTOTUNE_STATE State)
+{
+	WdfSpinLockAcquire(ReadAhead->Lock);
+	*State = ReadAhead->Autotune.State;
+	State->StageSize = ReadAhead->StageSize;
+	State->Depth = ReadAhead->ActiveDepth;
+	WdfSpinLockRelease(ReadAhead->Lock);
+}
+
+
+/*
+ * Sessions, see SESSION_SLOTS. Everything runs at PASSIVE_LEVEL and
+ * touches the table with SessionLock held only.
+ */
+static PSESSION UsbChief_SessionFind(IN ULONG Token)
+{
+	ULONG i;
+
+	for (i = 0; Token && i < SESSION_SLOTS; i++) {
+		if (Sessions[i].Token == Token)
+			return &Sessions[i];
 	}
+	return NULL;
+}
 
-	usbdPipeHandle = WdfUsbTargetPipeWdmGetPipeHandle(pipe);
+static VOID UsbChief_SessionSave(IN PDEVICE_CONTEXT DeviceContext, IN PFILE_CONTEXT FileContext,
+				 OUT PSESSION Session)
+{
+	PREAD_AHEAD readAhead = FileContext->ReadAhead;
+
+	if (DeviceContext->UsbInterface)
+		Session->AlternateSetting =
+			WdfUsbInterfaceGetConfiguredSettingIndex(DeviceContext->UsbInterface);
+	Session->Device = DeviceContext->UsbDeviceDescriptor;
+	Session->PipeHandle = FileContext->PipeHandle;
+	Session->PipeIndex = FileContext->PipeIndex;
+	Session->EndpointAddress = FileContext->EndpointAddress;
+	Session->ReadMode = FileContext->ReadMode;
+	Session->ReadTimeout = FileContext->ReadTimeout;
+	Session->ReadAhead = readAhead != NULL;
+	if (!readAhead)
+		return;
 
-	UsbBuildInterruptOrBulkTransferRequest(urb,
-					       sizeof(struct _URB_BULK_OR_INTERRUPT_TRANSFER),
-					       usbdPipeHandle,
-					       NULL,
-					       newMdl,
-					       stageLength,
-					       USBD_TRANSFER_DIRECTION_IN |
-					       USBD_SHORT_TRANSFER_OK,
-					       NULL);
+	/* the stage size as tuned so far, so a resume does not start over */
+	WdfSpinLockAcquire(readAhead->Lock);
+	Session->PipeMask = readAhead->PipeMask;
+	Session->ReadAheadParams.Size = readAhead->Size;
+	Session->ReadAheadParams.StageSize = readAhead->RequestedStageSize;
+	Session->ReadAheadParams.Depth = readAhead->Depth;
+	Session->Policy = readAhead->Policy;
+	Session->Autotune = readAhead->Autotune.Params;
+	Session->Autotune.Enable = readAhead->Autotune.Enabled;
+	WdfSpinLockRelease(readAhead->Lock);
+}
 
-	status = WdfUsbTargetPipeFormatRequestForUrb(pipe, Request, urbMemory, NULL  );
-	if (!NT_SUCCESS(status)) {
-		UsbChief_DbgPrint(0, ("Failed to format requset for urb\n"));
-		status = STATUS_INSUFFICIENT_RESOURCES;
-		goto Exit;
+/* the handle's token, a new one on first use; 0 if the table is full */
+static ULONG UsbChief_SessionGet(IN WDFFILEOBJECT FileObject)
+{
+	PDEVICE_CONTEXT deviceContext = GetDeviceContext(WdfFileObjectGetDevice(FileObject));
+	PFILE_CONTEXT fileContext = GetFileContext(FileObject);
+	LARGE_INTEGER frequency;
+	PSESSION session;
+	ULONGLONG now;
+	ULONG token = 0, i;
+
+	PAGED_CODE();
+
+	now = KeQueryPerformanceCounter(&frequency).QuadPart;
+
+	WdfWaitLockAcquire(SessionLock, NULL);
+	session = UsbChief_SessionFind(fileContext->SessionToken);
+
+	/* a free slot, or one whose device did not come back in time */
+	for (i = 0; !session && i < SESSION_SLOTS; i++) {
+		if (Sessions[i].Token && (Sessions[i].Attached || !Sessions[i].RemovedTime ||
+					  now - Sessions[i].RemovedTime <
+					  SESSION_TIMEOUT * (ULONGLONG)frequency.QuadPart))
+			continue;
+
+		session = &Sessions[i];
+		RtlZeroMemory(session, sizeof(*session));
+		if (!++SessionNextToken)
+			SessionNextToken++;
+		session->Token = SessionNextToken;
+		session->Attached = TRUE;
+		fileContext->SessionToken = session->Token;
 	}
-	WdfRequestSetCompletionRoutine(Request, UsbChief_ReadCompletion, NULL);
 
-	rwContext->UrbMemory       = urbMemory;
-	rwContext->Mdl             = newMdl;
-	rwContext->Length          = totalLength - stageLength;
-	rwContext->Numxfer         = 0;
-	rwContext->VirtualAddress  = virtualAddress + stageLength;
+	if (session) {
+		UsbChief_SessionSave(deviceContext, fileContext, session);
+		token = session->Token;
+	}
+	WdfWaitLockRelease(SessionLock);
+	return token;
+}
 
-	if (!WdfRequestSend(Request, WdfUsbTargetPipeGetIoTarget(pipe), WDF_NO_SEND_OPTIONS)) {
-		status = WdfRequestGetStatus(Request);
-		ASSERT(!NT_SUCCESS(status));
+static NTSTATUS UsbChief_SessionResume(IN WDFFILEOBJECT FileObject, IN ULONG Token)
+{
+	WDFDEVICE device = WdfFileObjectGetDevice(FileObject);
+	PDEVICE_CONTEXT deviceContext = GetDeviceContext(device);
+	PFILE_CONTEXT fileContext = GetFileContext(FileObject);
+	USBCHIEF_GAP_RECORD gap;
+	NTSTATUS status = STATUS_SUCCESS;
+	LARGE_INTEGER frequency;
+	PSESSION session;
+	SESSION saved;
+	ULONGLONG now;
+
+	PAGED_CODE();
+
+	if (fileContext->SessionToken || fileContext->ReadAhead)
+		return STATUS_DEVICE_BUSY;
+
+	now = KeQueryPerformanceCounter(&frequency).QuadPart;
+
+	WdfWaitLockAcquire(SessionLock, NULL);
+	session = UsbChief_SessionFind(Token);
+	if (session && !session->Attached && session->RemovedTime &&
+	    now - session->RemovedTime >= SESSION_TIMEOUT * (ULONGLONG)frequency.QuadPart) {
+		RtlZeroMemory(session, sizeof(*session));
+		session = NULL;
 	}
 
-Exit:
-	if (!NT_SUCCESS(status)) {
-		WdfRequestCompleteWithInformation(Request, status, 0);
+	if (!session) {
+		status = STATUS_NOT_FOUND;
+	} else if (session->Attached) {
+		status = STATUS_DEVICE_BUSY;
+	} else if (RtlCompareMemory(&session->Device, &deviceContext->UsbDeviceDescriptor,
+				    sizeof(USB_DEVICE_DESCRIPTOR)) != sizeof(USB_DEVICE_DESCRIPTOR) ||
+		   session->PipeHandle != fileContext->PipeHandle ||
+		   session->PipeIndex != fileContext->PipeIndex ||
+		   session->EndpointAddress != fileContext->EndpointAddress) {
+		/* another device, or another pipe of it */
+		status = STATUS_INVALID_PARAMETER;
+	} else {
+		session->Attached = TRUE;
+		saved = *session;
+		fileContext->SessionToken = Token;
+	}
+	WdfWaitLockRelease(SessionLock);
 
-		if (newMdl != NULL) {
-			IoFreeMdl(newMdl);
-		}
+	if (!NT_SUCCESS(status))
+		return status;
+
+	UsbChief_DbgPrint(DEBUG_CONFIG, ("session %d: setting %d, read-ahead %d, pipes %08x\n",
+					 Token, saved.AlternateSetting, saved.ReadAhead,
+					 saved.PipeMask));
+
+	if (deviceContext->UsbInterface && saved.AlternateSetting !=
+	    WdfUsbInterfaceGetConfiguredSettingIndex(deviceContext->UsbInterface)) {
+		status = UsbChief_SelectSetting(device, saved.AlternateSetting);
+		if (!NT_SUCCESS(status))
+			goto out;
+	}
+
+	fileContext->ReadMode = saved.ReadMode;
+	fileContext->ReadTimeout = saved.ReadTimeout;
+
+	if (saved.ReadAhead) {
+		RtlZeroMemory(&gap, sizeof(gap));
+		gap.FirstTimestamp = saved.RemovedTime;
+		gap.LastTimestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+		gap.Reason = USBCHIEF_GAP_REMOVED;
+
+		status = UsbChief_ReadAheadCreate(FileObject, saved.PipeMask, &saved.ReadAheadParams,
+						  saved.RemovedTime ? &gap : NULL);
+		if (!NT_SUCCESS(status))
+			goto out;
+
+		UsbChief_ReadAheadSetPolicy(fileContext->ReadAhead, saved.Policy);
+		if (saved.Autotune.Enable &&
+		    !NT_SUCCESS(UsbChief_AutotuneSet(FileObject, &saved.Autotune)))
+			UsbChief_DbgPrint(0, ("session %d: autotune not restored\n", Token));
 	}
+out:
+	WdfWaitLockAcquire(SessionLock, NULL);
+	session = UsbChief_SessionFind(Token);
+	if (NT_SUCCESS(status)) {
+		session->RemovedTime = 0;
+		UsbChief_SessionSave(deviceContext, fileContext, session);
+	} else {
+		/* left as it was, so the client may try again */
+		session->Attached = FALSE;
+		fileContext->SessionToken = 0;
+	}
+	WdfWaitLockRelease(SessionLock);
+	return status;
+}
+
+/* closed while the device is present ends the session, after a removal it waits for a resume */
+static VOID UsbChief_SessionClose(IN PDEVICE_CONTEXT DeviceContext, IN PFILE_CONTEXT FileContext)
+{
+	PSESSION session;
+
+	PAGED_CODE();
+
+	WdfWaitLockAcquire(SessionLock, NULL);
+	session = UsbChief_SessionFind(FileContext->SessionToken);
+	if (session && DeviceContext->Removed)
+		session->Attached = FALSE;
+	else if (session)
+		RtlZeroMemory(session, sizeof(*session));
+	FileContext->SessionToken = 0;
+	WdfWaitLockRelease(SessionLock);
 }
 
 
 static VOID UsbChief_EvtIoRead(IN WDFQUEUE Queue, IN WDFREQUEST Request, IN size_t Length)
 {
+	PDEVICE_CONTEXT         deviceContext;
 	PFILE_CONTEXT           fileContext = NULL;
 	WDFUSBPIPE              pipe;
-	WDF_USB_PIPE_INFORMATION   pipeInfo;
-
-	UNREFERENCED_PARAMETER(Queue);
 
 	PAGED_CODE();
 
 	UsbChief_DbgPrint(DEBUG_RW, ("EvtIoRead %d\n", Length));
 
+	deviceContext = GetDeviceContext(WdfIoQueueGetDevice(Queue));
+	if (deviceContext->Trace.Size)
+		GetRequestContext(Request)->StartTime = KeQueryPerformanceCounter(NULL).QuadPart;
+
 	fileContext = GetFileContext(WdfRequestGetFileObject(Request));
+
+	/* the pipe must not change between looking it up and sending */
+	UsbChief_DispatchEnter(deviceContext);
+
+	if (fileContext->ReadAhead) {
+		UsbChief_ReadAheadRead(fileContext->ReadAhead, Request);
+		goto out;
+	}
+
 	pipe = fileContext->Pipe;
 	if (pipe == NULL) {
 		UsbChief_DbgPrint(0, ("pipe handle is NULL\n"));
-		WdfRequestCompleteWithInformation(Request, STATUS_INVALID_PARAMETER, 0);
-		return;
+		UsbChief_CompleteRead(deviceContext, Request, STATUS_INVALID_PARAMETER, 0);
+		goto out;
 	}
-	WDF_USB_PIPE_INFORMATION_INIT(&pipeInfo);
-	WdfUsbTargetPipeGetInformation(pipe, &pipeInfo);
 
 	UsbChief_ReadEndPoint(Queue, Request, (ULONG) Length);
+out:
+	UsbChief_DispatchLeave(deviceContext);
 }
 
 static VOID UsbChief_EvtIoWrite(IN WDFQUEUE Queue, IN WDFREQUEST Request, IN size_t Length)
@@ -877,10 +3698,53 @@ static VOID UsbChief_EvtIoResume(IN WDFQUEUE Queue, IN WDFREQUEST Request)
 	WdfRequestCompleteWithInformation(Request, STATUS_INVALID_DEVICE_REQUEST, 0);
 }
 
+/*
+ * Handles stay open until the client closes them. Take the setup of every
+ * session now and when the device went away, for IOCTL_RESUME_SESSION.
+ */
+static VOID UsbChief_EvtDeviceSurpriseRemoval(IN WDFDEVICE Device)
+{
+	PDEVICE_CONTEXT pDeviceContext;
+	PFILE_CONTEXT pFileContext;
+	PLIST_ENTRY entry;
+	PSESSION session;
+	ULONGLONG now;
+
+	PAGED_CODE();
+
+	pDeviceContext = GetDeviceContext(Device);
+	now = KeQueryPerformanceCounter(NULL).QuadPart;
+
+	WdfWaitLockAcquire(SessionLock, NULL);
+	WdfWaitLockAcquire(pDeviceContext->OpenFilesLock, NULL);
+
+	pDeviceContext->Removed = TRUE;
+	for (entry = pDeviceContext->OpenFiles.Flink; entry != &pDeviceContext->OpenFiles;
+	     entry = entry->Flink) {
+		pFileContext = CONTAINING_RECORD(entry, FILE_CONTEXT, Link);
+		session = UsbChief_SessionFind(pFileContext->SessionToken);
+		if (session) {
+			UsbChief_SessionSave(pDeviceContext, pFileContext, session);
+			session->RemovedTime = now;
+			UsbChief_DbgPrint(DEBUG_CONFIG, ("session %d kept for resume\n", session->Token));
+		}
+
+		/* no stage will fill them again; the client closes and resumes */
+		if (pFileContext->ReadAhead)
+			UsbChief_ReadAheadFailReads(pFileContext->ReadAhead, STATUS_DEVICE_REMOVED);
+	}
+
+	WdfWaitLockRelease(pDeviceContext->OpenFilesLock);
+	WdfWaitLockRelease(SessionLock);
+}
+
 static NTSTATUS UsbChief_EvtDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT DeviceInit)
 {
 	WDF_PNPPOWER_EVENT_CALLBACKS pnpPowerCallbacks;
 	WDF_OBJECT_ATTRIBUTES fileObjectAttributes, requestAttributes, fdoAttributes;
+	WDF_OBJECT_ATTRIBUTES lockAttributes;
+	WDFMEMORY pipesMemory;
+	LARGE_INTEGER frequency;
 	WDF_FILEOBJECT_CONFIG fileConfig;
 	NTSTATUS Status;
 	WDFDEVICE device;
@@ -897,6 +3761,7 @@ static NTSTATUS UsbChief_EvtDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT De
 	/* Init PnP */
 	WDF_PNPPOWER_EVENT_CALLBACKS_INIT(&pnpPowerCallbacks);
 	pnpPowerCallbacks.EvtDevicePrepareHardware = UsbChief_EvtDevicePrepareHardware;
+	pnpPowerCallbacks.EvtDeviceSurpriseRemoval = UsbChief_EvtDeviceSurpriseRemoval;
 	WdfDeviceInitSetPnpPowerEventCallbacks(DeviceInit, &pnpPowerCallbacks);
 
 	/* Request Attributes */
@@ -908,7 +3773,7 @@ static NTSTATUS UsbChief_EvtDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT De
 
 	WDF_FILEOBJECT_CONFIG_INIT(&fileConfig, UsbChief_EvtDeviceFileCreate,
 			WDF_NO_EVENT_CALLBACK,
-			WDF_NO_EVENT_CALLBACK);
+			UsbChief_EvtFileCleanup);
 
 	WDF_OBJECT_ATTRIBUTES_INIT(&fileObjectAttributes);
 	WDF_OBJECT_ATTRIBUTES_SET_CONTEXT_TYPE(&fileObjectAttributes, FILE_CONTEXT);
@@ -923,6 +3788,59 @@ static NTSTATUS UsbChief_EvtDeviceAdd(IN WDFDRIVER Driver, IN PWDFDEVICE_INIT De
 		return Status;
 	}
 
+	WDF_OBJECT_ATTRIBUTES_INIT(&lockAttributes);
+	lockAttributes.ParentObject = device;
+
+	Status = WdfWaitLockCreate(&lockAttributes, &GetDeviceContext(device)->DownloadLock);
+	if (!NT_SUCCESS(Status)) {
+		UsbChief_DbgPrint(0, ("WdfWaitLockCreate: %08x\n", Status));
+		goto out;
+	}
+
+	Status = WdfWaitLockCreate(&lockAttributes, &GetDeviceContext(device)->OpenFilesLock);
+	if (!NT_SUCCESS(Status)) {
+		UsbChief_DbgPrint(0, ("WdfWaitLockCreate: %08x\n", Status));
+		goto out;
+	}
+	InitializeListHead(&GetDeviceContext(device)->OpenFiles);
+
+	Status = WdfWaitLockCreate(&lockAttributes, &GetDeviceContext(device)->SettingLock);
+	if (!NT_SUCCESS(Status)) {
+		UsbChief_DbgPrint(0, ("WdfWaitLockCreate: %08x\n", Status));
+		goto out;
+	}
+	KeInitializeEvent(&GetDeviceContext(device)->DispatchIdle, NotificationEvent, TRUE);
+
+	Status = WdfSpinLockCreate(&lockAttributes, &GetDeviceContext(device)->Trace.Lock);
+	if (!NT_SUCCESS(Status)) {
+		UsbChief_DbgPrint(0, ("WdfSpinLockCreate: %08x\n", Status));
+		goto out;
+	}
+
+	Status = WdfWaitLockCreate(&lockAttributes, &GetDeviceContext(device)->AnalyticsSetLock);
+	if (!NT_SUCCESS(Status)) {
+		UsbChief_DbgPrint(0, ("WdfWaitLockCreate: %08x\n", Status));
+		goto out;
+	}
+
+	Status = WdfSpinLockCreate(&lockAttributes, &GetDeviceContext(device)->AnalyticsLock);
+	if (!NT_SUCCESS(Status)) {
+		UsbChief_DbgPrint(0, ("WdfSpinLockCreate: %08x\n", Status));
+		goto out;
+	}
+
+	KeQueryPerformanceCounter(&frequency);
+	GetDeviceContext(device)->CounterFrequency = frequency.QuadPart;
+
+	Status = WdfMemoryCreate(&lockAttributes, NonPagedPoolCacheAligned, POOL_TAG,
+				 USBCHIEF_MAX_PIPES * sizeof(PIPE_CONTEXT), &pipesMemory,
+				 (PVOID *)&GetDeviceContext(device)->Pipes);
+	if (!NT_SUCCESS(Status)) {
+		UsbChief_DbgPrint(0, ("WdfMemoryCreate: %08x\n", Status));
+		goto out;
+	}
+	RtlZeroMemory(GetDeviceContext(device)->Pipes, USBCHIEF_MAX_PIPES * sizeof(PIPE_CONTEXT));
+
 	RtlInitUnicodeString(&linkname, L"\\DosDevices\\ChiefUSB");
 	Status = WdfDeviceCreateSymbolicLink(device, &linkname);
 	if (!NT_SUCCESS(Status)) {
@@ -968,6 +3886,7 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING Registry
 	WPP_INIT_TRACING(DriverObject, RegistryPath);
 
 	UsbChief_DbgPrint(DEBUG_CONFIG, ("starting\n"));
+	UsbChief_InitCrc32c();
 	WDF_DRIVER_CONFIG_INIT(&Config, UsbChief_EvtDeviceAdd);
 	Status = WdfDriverCreate(DriverObject, RegistryPath,
 		WDF_NO_OBJECT_ATTRIBUTES, &Config, WDF_NO_HANDLE);
@@ -975,5 +3894,11 @@ NTSTATUS DriverEntry(IN PDRIVER_OBJECT DriverObject, IN PUNICODE_STRING Registry
 		UsbChief_DbgPrint(0, ("WdfDriverCreate failed: 0x%08x\n", Status));
 		return Status;
 	}
+
+	Status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &SessionLock);
+	if (!NT_SUCCESS(Status)) {
+		UsbChief_DbgPrint(0, ("WdfWaitLockCreate failed: 0x%08x\n", Status));
+		return Status;
+	}
 	return STATUS_SUCCESS;
 }
@@ -54,8 +54,54 @@ typedef enum {
 
 DEFINE_GUID(GUID_CLASS_USBCHIEF_USB, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
 
+#define USBCHIEF_MAX_PIPES 32
+
+/* EndpointMap slot of an endpoint address: number plus direction bit */
+#define USBCHIEF_ENDPOINT_SLOT(_a) (((_a) & 0x0f) | (((_a) & 0x80) >> 3))
+
+/* stage latency histogram: bucket b counts stages of less than 2^b us */
+#define ANALYTICS_BUCKETS 24
+
+typedef struct _PIPE_STATS {
+	LONG64 Transfers;
+	LONG64 Bytes;
+	LONG Errors;
+	LONG ShortTransfers;
+	LONG Latency[ANALYTICS_BUCKETS];
+} PIPE_STATS, *PPIPE_STATS;
+
+/*
+ * What the I/O path needs to know about a configured pipe, filled in
+ * once per configuration or alternate setting so that reads never have
+ * to ask the framework. Cache line aligned, so completions running on
+ * different pipes do not share lines.
+ */
+typedef struct DECLSPEC_CACHEALIGN _PIPE_CONTEXT {
+	WDFUSBPIPE Pipe;
+	USBD_PIPE_HANDLE UsbdPipeHandle;
+	WDF_USB_PIPE_TYPE PipeType;
+	BOOLEAN In;
+	UCHAR EndpointAddress;
+	UCHAR Index;
+	UCHAR Interval;
+	ULONG MaximumPacketSize;
+	ULONG MaximumTransferSize;
+	ULONG StageSize;	/* largest stage, in whole packets */
+	PIPE_STATS Stats;
+} PIPE_CONTEXT, *PPIPE_CONTEXT;
+
 typedef struct _FILE_CONTEXT {
 	WDFUSBPIPE Pipe;
+	PPIPE_CONTEXT PipeContext;
+	ULONG ReadMode;
+	ULONG ReadTimeout;
+	struct _READ_AHEAD *ReadAhead;
+	/* pipe handles only, to rebind them after an alternate setting switch */
+	BOOLEAN PipeHandle;
+	UCHAR PipeIndex;
+	UCHAR EndpointAddress;	/* opened by endpoint address, 0 if by index */
+	ULONG SessionToken;	/* 0 without a session */
+	LIST_ENTRY Link;
 } FILE_CONTEXT, *PFILE_CONTEXT;
 
 typedef struct _REQUEST_CONTEXT {
@@ -64,8 +110,43 @@ typedef struct _REQUEST_CONTEXT {
 	ULONG Numxfer;
 	ULONG_PTR VirtualAddress;
 	WDFMEMORY UrbMemory;
+	ULONG ReadMode;
+	ULONG MaximumPacketSize;
+	ULONG StageLength;
+	ULONG ReadTimeout;
+	PPIPE_CONTEXT PipeContext;
+	ULONGLONG StartTime;		/* arrival, for the trace */
+	ULONGLONG StageTime;		/* current stage sent */
+	/* framed reads only */
+	ULONG_PTR BaseAddress;
+	PUCHAR FrameBuffer;
+	ULONG FrameOffset;
+	ULONG TotalLength;
 } REQUEST_CONTEXT, *PREQUEST_CONTEXT;
 
+#define DOWNLOAD_SLOTS 4
+#define DOWNLOAD_TIMEOUT 5000	/* ms per vendor request */
+
+typedef struct _DOWNLOAD_SLOT {
+	WDFREQUEST Request;
+	WDFMEMORY UrbMemory;
+	PURB Urb;
+	KEVENT Done;
+	NTSTATUS Status;
+	ULONG Length;
+	BOOLEAN Busy;
+} DOWNLOAD_SLOT, *PDOWNLOAD_SLOT;
+
+typedef struct _TRACE {
+	WDFSPINLOCK Lock;
+	WDFMEMORY Memory;
+	struct _USBCHIEF_TRACE_RECORD *Records;
+	ULONG Size;		/* records, 0 while not recording */
+	ULONG Head;		/* next record written */
+	ULONG Used;
+	ULONG Sequence;
+} TRACE, *PTRACE;
+
 typedef struct _DEVICE_CONTEXT {
 	USB_DEVICE_DESCRIPTOR UsbDeviceDescriptor;
 	PUSB_CONFIGURATION_DESCRIPTOR UsbConfigurationDescriptor;
@@ -74,12 +155,34 @@ typedef struct _DEVICE_CONTEXT {
 	WDFUSBDEVICE WdfUsbTargetDevice;
 	WDFUSBINTERFACE UsbInterface;
 	UCHAR NumberConfiguredPipes;
+	PPIPE_CONTEXT Pipes;		/* USBCHIEF_MAX_PIPES entries */
+	UCHAR EndpointMap[32];		/* pipe index + 1 by USBCHIEF_ENDPOINT_SLOT */
 	ULONG MaximumTransferSize;
+	LONG FrameSequence;
+	LONG ReadAheadBytes;		/* charged against READ_AHEAD_DEVICE_BUDGET */
+	WDFWAITLOCK DownloadLock;
+	DOWNLOAD_SLOT DownloadSlots[DOWNLOAD_SLOTS];
+	LONG DownloadDone;
+	LONG DownloadTotal;
+	WDFWAITLOCK OpenFilesLock;
+	LIST_ENTRY OpenFiles;
+	/* dispatch routines using pipes, drained by a setting switch */
+	WDFWAITLOCK SettingLock;
+	LONG Dispatching;
+	KEVENT DispatchIdle;
+	ULONG SettingGeneration;	/* bumped by every setting switch */
+	TRACE Trace;
+	BOOLEAN Removed;		/* surprise removed, handles keep their sessions */
+	ULONGLONG CounterFrequency;
+	WDFWAITLOCK AnalyticsSetLock;	/* one IOCTL_SET_ANALYTICS at a time */
+	WDFSPINLOCK AnalyticsLock;
+	struct _ANALYTICS *Analytics;	/* NULL while not running */
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
 typedef struct _WORKITEM_CONTEXT {
 	WDFDEVICE       Device;
-	WDFUSBPIPE      Pipe;
+	PPIPE_CONTEXT   PipeContext;	/* outlives the pipe */
+	ULONG           SettingGeneration;	/* no reset after a switch */
 } WORKITEM_CONTEXT, *PWORKITEM_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(WORKITEM_CONTEXT, GetWorkItemContext)
@@ -102,4 +205,547 @@ typedef struct _IOCTL_DATA {
 #define IOCTL_VENDOR_READ CTL_CODE(FILE_DEVICE_UNKNOWN, 1, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_SELECT_CONFIGURATION CTL_CODE(FILE_DEVICE_UNKNOWN, 2, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_GET_FIRMWARE_VERSION CTL_CODE(FILE_DEVICE_UNKNOWN, 3, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SET_READ_MODE CTL_CODE(FILE_DEVICE_UNKNOWN, 4, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_TIMESTAMP_BASE CTL_CODE(FILE_DEVICE_UNKNOWN, 5, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*
+ * IOCTL_SET_READ_TIMEOUT takes a DWORD in milliseconds, 0 disables it.
+ * With a timeout set, a stage that does not finish in time is cancelled
+ * and a read that holds any data by then completes with what it has, so
+ * large buffers no longer stall a live view on a quiet bus. Reads that
+ * have not seen any data keep waiting.
+ */
+#define IOCTL_SET_READ_TIMEOUT CTL_CODE(FILE_DEVICE_UNKNOWN, 6, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SET_READ_AHEAD CTL_CODE(FILE_DEVICE_UNKNOWN, 7, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_READ_AHEAD_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 8, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SET_OVERFLOW_POLICY CTL_CODE(FILE_DEVICE_UNKNOWN, 9, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_VENDOR_DOWNLOAD CTL_CODE(FILE_DEVICE_UNKNOWN, 10, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_DOWNLOAD_PROGRESS CTL_CODE(FILE_DEVICE_UNKNOWN, 11, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_DEVICE_INFO CTL_CODE(FILE_DEVICE_UNKNOWN, 12, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_START_CAPTURE CTL_CODE(FILE_DEVICE_UNKNOWN, 13, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SET_AUTOTUNE CTL_CODE(FILE_DEVICE_UNKNOWN, 14, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_AUTOTUNE CTL_CODE(FILE_DEVICE_UNKNOWN, 15, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SET_TRACE CTL_CODE(FILE_DEVICE_UNKNOWN, 16, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_TRACE CTL_CODE(FILE_DEVICE_UNKNOWN, 17, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_SESSION CTL_CODE(FILE_DEVICE_UNKNOWN, 18, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_RESUME_SESSION CTL_CODE(FILE_DEVICE_UNKNOWN, 19, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SET_ANALYTICS CTL_CODE(FILE_DEVICE_UNKNOWN, 20, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_ANALYTICS CTL_CODE(FILE_DEVICE_UNKNOWN, 21, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_SET_FILTER CTL_CODE(FILE_DEVICE_UNKNOWN, 22, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_GET_FILTER_STATS CTL_CODE(FILE_DEVICE_UNKNOWN, 23, METHOD_BUFFERED, FILE_ANY_ACCESS)
+
+/*
+ * Read modes, set per handle with IOCTL_SET_READ_MODE (DWORD input).
+ *
+ * In framed mode every completed bulk stage is stored in the read buffer
+ * as a USBCHIEF_FRAME_HEADER followed by Length payload bytes, padded to
+ * USBCHIEF_FRAME_ALIGN. The returned byte count covers all frames. Since
+ * each frame starts with a magic and carries a global sequence number and
+ * a timestamp, a capture made of framed reads can be split at arbitrary
+ * offsets, resynchronized on the next header and decoded in parallel.
+ *
+ * READ_MODE_TRANSFER completes a read as soon as a stage ends with a short
+ * packet, i.e. as soon as the device finished a USB transfer, instead of
+ * waiting for the buffer to fill. Framed stages that ended a transfer carry
+ * USBCHIEF_FRAME_END_OF_TRANSFER, so consumers can reassemble transfers
+ * incrementally with no more state than the transfer being built.
+ */
+#define READ_MODE_RAW		0x00000000
+#define READ_MODE_FRAMED	0x00000001
+#define READ_MODE_TRANSFER	0x00000002
+#define READ_MODE_MASK		(READ_MODE_FRAMED | READ_MODE_TRANSFER)
+
+#define USBCHIEF_FRAME_MAGIC	0x52464843	/* "CHFR" */
+#define USBCHIEF_FRAME_ALIGN	8
+#define USBCHIEF_FRAME_ALIGN_UP(_x) \
+	(((_x) + USBCHIEF_FRAME_ALIGN - 1) & ~(USBCHIEF_FRAME_ALIGN - 1))
+
+typedef struct _USBCHIEF_FRAME_HEADER {
+	DWORD Magic;
+	WORD HeaderLength;
+	WORD Flags;
+	DWORD Length;
+	DWORD Sequence;
+	ULONGLONG Timestamp;	/* KeQueryPerformanceCounter() at stage completion */
+	DWORD Crc32c;		/* CRC32C (Castagnoli) of the payload */
+	BYTE EndpointAddress;	/* endpoint the payload came from, 0 for gap frames */
+	BYTE Pipe;		/* and its pipe index */
+	WORD Reserved;
+} USBCHIEF_FRAME_HEADER, *PUSBCHIEF_FRAME_HEADER;
+
+#define USBCHIEF_FRAME_END_OF_TRANSFER	0x0001
+#define USBCHIEF_FRAME_CRC32C		0x0002	/* Crc32c is valid */
+#define USBCHIEF_FRAME_GAP		0x0004	/* payload is a USBCHIEF_GAP_RECORD */
+
+/*
+ * Payload of a USBCHIEF_FRAME_GAP frame: what was lost between the frame
+ * before it and the frame after it. Timestamps are performance counter
+ * values like frame timestamps; LostBytes is 0 when the data was left in
+ * the device because the driver stopped reading (OVERFLOW_POLICY_BLOCK).
+ */
+typedef struct _USBCHIEF_GAP_RECORD {
+	ULONGLONG FirstTimestamp;
+	ULONGLONG LastTimestamp;
+	ULONGLONG LostBytes;
+	DWORD LostFrames;
+	DWORD Reason;
+} USBCHIEF_GAP_RECORD, *PUSBCHIEF_GAP_RECORD;
+
+#define USBCHIEF_GAP_OVERFLOW	0x0001	/* ring full, stages discarded */
+#define USBCHIEF_GAP_BLOCKED	0x0002	/* no read posted on the pipe */
+#define USBCHIEF_GAP_REMOVED	0x0004	/* device was gone, see IOCTL_RESUME_SESSION */
+
+/*
+ * IOCTL_GET_TIMESTAMP_BASE output. Counter and SystemTime are sampled
+ * together, so a frame timestamp converts to wall clock time as
+ * SystemTime + (Timestamp - Counter) * 10000000 / Frequency.
+ */
+typedef struct _USBCHIEF_TIMESTAMP_BASE {
+	ULONGLONG Frequency;	/* performance counter ticks per second */
+	ULONGLONG Counter;
+	ULONGLONG SystemTime;	/* 100ns units since 1601, UTC */
+} USBCHIEF_TIMESTAMP_BASE, *PUSBCHIEF_TIMESTAMP_BASE;
+
+/*
+ * IOCTL_VENDOR_DOWNLOAD input: this header directly followed by Length image
+ * bytes. The image goes out as vendor OUT requests of ChunkSize bytes with
+ * the given Request and Index, Value starting at Address and advancing by
+ * the chunk size. The transfers are queued back to back on the default
+ * pipe. With DOWNLOAD_VERIFY every chunk is read back with the same request
+ * afterwards and compared. IOCTL_GET_DOWNLOAD_PROGRESS returns a
+ * USBCHIEF_DOWNLOAD_PROGRESS for a download running on another thread.
+ */
+typedef struct _USBCHIEF_DOWNLOAD {
+	BYTE Request;
+	BYTE Flags;
+	WORD Address;
+	WORD Index;
+	WORD ChunkSize;
+	DWORD Length;
+} USBCHIEF_DOWNLOAD, *PUSBCHIEF_DOWNLOAD;
+
+#define DOWNLOAD_VERIFY		0x01
+
+typedef struct _USBCHIEF_DOWNLOAD_PROGRESS {
+	DWORD Done;
+	DWORD Total;
+} USBCHIEF_DOWNLOAD_PROGRESS, *PUSBCHIEF_DOWNLOAD_PROGRESS;
+
+/*
+ * IOCTL_SET_READ_AHEAD input. The driver keeps Depth reads of StageSize
+ * bytes posted on the handle's pipe and stores completed stages as frames
+ * in a Size byte ring of non-paged memory, whether or not a read is
+ * pending. Reads on the handle are then served from the ring and complete
+ * as soon as anything is buffered, with whole frames in framed mode and
+ * bare payload otherwise. Zero fields select the defaults. Read-ahead
+ * stays on until the handle is closed. All handles of a device share
+ * READ_AHEAD_DEVICE_BUDGET bytes of rings and stage buffers; past it the
+ * request fails with STATUS_INSUFFICIENT_RESOURCES.
+ */
+typedef struct _USBCHIEF_READ_AHEAD_PARAMS {
+	DWORD Size;
+	DWORD StageSize;
+	DWORD Depth;
+} USBCHIEF_READ_AHEAD_PARAMS, *PUSBCHIEF_READ_AHEAD_PARAMS;
+
+/*
+ * IOCTL_START_CAPTURE input: read-ahead on every IN pipe in PipeMask (bit
+ * n for pipe index n) into one ring, on any handle including the root
+ * device. Depth stages are kept posted per pipe. Frames from all pipes are
+ * stored in the order their stages completed, numbered and timestamped
+ * under the ring lock, and carry their endpoint in the frame header, so a
+ * framed read returns one merged stream in global order.
+ */
+typedef struct _USBCHIEF_CAPTURE_PARAMS {
+	DWORD PipeMask;
+	USBCHIEF_READ_AHEAD_PARAMS ReadAhead;
+} USBCHIEF_CAPTURE_PARAMS, *PUSBCHIEF_CAPTURE_PARAMS;
+
+/*
+ * IOCTL_SET_AUTOTUNE input, for a handle with read-ahead or a capture.
+ * Every Interval ms the driver looks at the stages completed since the
+ * last look and may make one change:
+ *
+ * - average stage latency (post to completion) above LatencyTarget:
+ *   halve the stage size, or at MinStageSize drop one stage per pipe;
+ * - latency below half of LatencyTarget and stages mostly filled up:
+ *   try doubling the stage size, or at MaxStageSize one more stage per
+ *   pipe. A try is kept only if the next interval moves at least 1/16
+ *   more data; otherwise it is undone and no try is made for a while.
+ *
+ * The gap between the two latency limits and the hold-off after an undo
+ * keep the controller from oscillating. MaxDepth cannot exceed the depth
+ * read-ahead was started with. Zero fields select the defaults; Enable 0
+ * stops tuning and keeps the current values.
+ */
+typedef struct _USBCHIEF_AUTOTUNE_PARAMS {
+	DWORD Enable;
+	DWORD MinStageSize;
+	DWORD MaxStageSize;
+	DWORD MinDepth;
+	DWORD MaxDepth;
+	DWORD Interval;		/* ms */
+	DWORD LatencyTarget;	/* us */
+} USBCHIEF_AUTOTUNE_PARAMS, *PUSBCHIEF_AUTOTUNE_PARAMS;
+
+#define AUTOTUNE_NONE		0
+#define AUTOTUNE_GROW_STAGE	1
+#define AUTOTUNE_GROW_DEPTH	2
+#define AUTOTUNE_SHRINK_STAGE	3
+#define AUTOTUNE_SHRINK_DEPTH	4
+#define AUTOTUNE_KEEP		5	/* a try paid off */
+#define AUTOTUNE_REVERT		6	/* a try did not, undone */
+
+/* IOCTL_GET_AUTOTUNE output; the measurements are of the last interval */
+typedef struct _USBCHIEF_AUTOTUNE_STATE {
+	DWORD Enabled;
+	DWORD StageSize;	/* largest over the pipes */
+	DWORD Depth;		/* stages kept posted per pipe */
+	DWORD Decision;		/* AUTOTUNE_* of the last interval */
+	DWORD Changes;
+	DWORD Reverts;
+	ULONGLONG Throughput;	/* bytes per second */
+	DWORD Latency;		/* us */
+	DWORD ShortRate;	/* short stages per 256 */
+} USBCHIEF_AUTOTUNE_STATE, *PUSBCHIEF_AUTOTUNE_STATE;
+
+/*
+ * Capture filter of a handle with read-ahead: transfers a rule matches are
+ * dropped before they are checksummed and stored. IOCTL_SET_FILTER takes
+ * an array of up to FILTER_MAX_RULES rules, an empty one clears the filter;
+ * either way the counters start over. Rules look at the first stage of a
+ * transfer only: it matches if it comes from the rule's endpoint with a
+ * payload length in MinLength..MaxLength and its little-endian DWORD at
+ * Offset, masked with Mask, equals Value. The first matching rule counts
+ * the transfer, and its stages are dropped up to the one that ends it, so
+ * a reader only ever sees whole transfers. An all-zero rule drops
+ * zero-length transfers on every endpoint, the bulk of what an idle
+ * endpoint returns.
+ */
+#define FILTER_MAX_RULES	16
+
+typedef struct _USBCHIEF_FILTER_RULE {
+	BYTE EndpointAddress;	/* 0 for every endpoint */
+	BYTE Reserved;
+	WORD Offset;
+	DWORD MinLength;
+	DWORD MaxLength;
+	DWORD Mask;		/* 0 skips the payload test */
+	DWORD Value;
+} USBCHIEF_FILTER_RULE, *PUSBCHIEF_FILTER_RULE;
+
+/* IOCTL_GET_FILTER_STATS output */
+typedef struct _USBCHIEF_FILTER_STATS {
+	ULONGLONG Frames;	/* stages the filter looked at */
+	ULONGLONG Filtered;	/* stages dropped */
+	ULONGLONG BytesSaved;	/* ring bytes, header and padding included */
+	ULONGLONG Transfers;	/* transfers dropped */
+	ULONGLONG Matches[FILTER_MAX_RULES];	/* transfers, by rule */
+} USBCHIEF_FILTER_STATS, *PUSBCHIEF_FILTER_STATS;
+
+/*
+ * What read-ahead does when the ring cannot take another stage, set with
+ * IOCTL_SET_OVERFLOW_POLICY (DWORD) on a handle with read-ahead enabled:
+ * discard the stage that just arrived, discard the oldest buffered frames,
+ * or stop posting reads until the client made room. Every loss is recorded
+ * in the stream as a USBCHIEF_FRAME_GAP frame at the place it happened.
+ * Raw reads skip gap frames.
+ */
+#define OVERFLOW_POLICY_DROP_NEWEST	0
+#define OVERFLOW_POLICY_DROP_OLDEST	1
+#define OVERFLOW_POLICY_BLOCK		2
+
+/* IOCTL_GET_READ_AHEAD_STATS output */
+typedef struct _USBCHIEF_READ_AHEAD_STATS {
+	DWORD Size;
+	DWORD Used;
+	DWORD HighWater;
+	DWORD Overflows;	/* stages lost because the ring was full */
+	ULONGLONG OverflowBytes;
+	ULONGLONG Frames;
+	ULONGLONG Bytes;
+	DWORD Policy;
+	DWORD Gaps;		/* gap frames put into the stream */
+	ULONGLONG BlockedTime;	/* counter ticks with no read posted */
+} USBCHIEF_READ_AHEAD_STATS, *PUSBCHIEF_READ_AHEAD_STATS;
+
+/*
+ * Live bus statistics. IOCTL_SET_ANALYTICS publishes a snapshot every
+ * Interval ms, covering the last Windows intervals; Interval 0 stops.
+ * IOCTL_GET_ANALYTICS returns the latest snapshot, Sequence tells a new
+ * one from the last. Latency is from a stage being sent to its completion
+ * in ANALYTICS_BUCKETS log2 buckets; percentiles are the upper bound of
+ * their bucket. Busiest holds the endpoints that moved the most bytes in
+ * the window, busiest first, 0 when unused.
+ */
+#define ANALYTICS_MAX_WINDOWS	16
+#define ANALYTICS_MIN_INTERVAL	100
+#define ANALYTICS_TOP		4
+
+typedef struct _USBCHIEF_ANALYTICS_PARAMS {
+	DWORD Interval;		/* ms */
+	DWORD Windows;		/* 1 to ANALYTICS_MAX_WINDOWS */
+} USBCHIEF_ANALYTICS_PARAMS, *PUSBCHIEF_ANALYTICS_PARAMS;
+
+typedef struct _USBCHIEF_PIPE_ANALYTICS {
+	BYTE EndpointAddress;
+	BYTE Reserved[3];
+	DWORD Transfers;
+	DWORD Errors;
+	DWORD ShortTransfers;
+	ULONGLONG Bytes;
+	ULONGLONG Bandwidth;	/* bytes per second */
+	DWORD LatencyP50;	/* us */
+	DWORD LatencyP90;
+	DWORD LatencyP99;
+	DWORD Reserved2;
+	DWORD Latency[ANALYTICS_BUCKETS];
+} USBCHIEF_PIPE_ANALYTICS, *PUSBCHIEF_PIPE_ANALYTICS;
+
+typedef struct _USBCHIEF_ANALYTICS {
+	DWORD Sequence;
+	DWORD Windows;		/* intervals covered, fewer right after the start */
+	ULONGLONG Timestamp;	/* end of the window, like frame timestamps */
+	ULONGLONG Duration;	/* us */
+	ULONGLONG Bytes;
+	ULONGLONG Bandwidth;	/* bytes per second, all pipes */
+	DWORD Transfers;
+	DWORD Errors;
+	BYTE NumberOfPipes;
+	BYTE Busiest[ANALYTICS_TOP];
+	BYTE Reserved[3];
+	USBCHIEF_PIPE_ANALYTICS Pipes[USBCHIEF_MAX_PIPES];
+} USBCHIEF_ANALYTICS, *PUSBCHIEF_ANALYTICS;
+
+/*
+ * Sessions that outlive the device. IOCTL_GET_SESSION returns a DWORD
+ * token for the handle and remembers its setup: alternate setting, read
+ * mode and timeout, read-ahead or capture with overflow policy and
+ * autotuning. The setup is taken again when the device is surprise
+ * removed. Once the device is back, IOCTL_RESUME_SESSION with the token
+ * on a new handle, opened by the same name, applies all of it and starts
+ * the stream with a USBCHIEF_GAP_REMOVED gap frame covering the outage;
+ * the token stays valid for the new handle. The device descriptor and the
+ * pipe the handle was opened on must match, else the resume is refused.
+ * On removal, reads parked on the old handle fail with
+ * STATUS_DEVICE_REMOVED; the old handle must be closed before the resume,
+ * which fails with STATUS_DEVICE_BUSY while it is open. A session ends
+ * when its handle is closed while the device is present, or
+ * SESSION_TIMEOUT seconds after a removal if nobody resumed it.
+ */
+#define SESSION_SLOTS		16
+#define SESSION_TIMEOUT		300
+
+/*
+ * Session trace, to take the timing of a field session offline.
+ * IOCTL_SET_TRACE (DWORD) starts recording into a ring of that many
+ * records and drops any earlier trace; 0 stops recording. The driver logs
+ * every client read and every bus stage with the time it started and
+ * completed, its lengths and status, every pipe reset and every IOCTL with
+ * the first TRACE_PAYLOAD_SIZE bytes of its input. IOCTL_GET_TRACE moves
+ * the oldest records into the output buffer, as many whole records as fit.
+ * A full ring overwrites its oldest records, which shows as a jump in
+ * Sequence. Times are performance counter values like frame timestamps.
+ * The ring is non-paged, hence the small TRACE_MAX_RECORDS. For
+ * IOCTL_VENDOR_WRITE and IOCTL_VENDOR_READ the payload is the IOCTL_DATA
+ * setup only: the data stage lives in the caller's buffer and is not
+ * recorded, so a replay has to supply it.
+ */
+#define TRACE_MAX_RECORDS	(16 * 1024)
+#define TRACE_PAYLOAD_SIZE	32
+
+#define TRACE_READ	1	/* client read completed */
+#define TRACE_STAGE	2	/* bus transfer completed */
+#define TRACE_RESET	3	/* pipe reset after an error */
+#define TRACE_IOCTL	4	/* device control completed */
+
+typedef struct _USBCHIEF_TRACE_RECORD {
+	ULONGLONG StartTime;	/* request arrival or stage sent */
+	ULONGLONG Timestamp;	/* completion */
+	DWORD Sequence;
+	BYTE Type;
+	BYTE EndpointAddress;	/* 0 for IOCTLs */
+	WORD PayloadLength;
+	DWORD Status;
+	DWORD Code;		/* IOCTL code, read mode for reads */
+	DWORD Length;		/* requested */
+	DWORD Information;	/* transferred */
+	BYTE Payload[TRACE_PAYLOAD_SIZE];
+} USBCHIEF_TRACE_RECORD, *PUSBCHIEF_TRACE_RECORD;
+
+/*
+ * IOCTL_GET_DEVICE_INFO output: everything a client needs at startup in
+ * one call. The header is followed by the USB_DEVICE_DESCRIPTOR, the full
+ * configuration descriptor and NumberOfPipes USBCHIEF_PIPE_INFO entries of
+ * PipeInfoLength bytes each, all found through the offsets from the start
+ * of the header. If the buffer only holds the header, it is returned with
+ * STATUS_BUFFER_OVERFLOW and Length tells the size to retry with. Newer
+ * versions only append fields, so a client checks Version and uses the
+ * offsets and lengths rather than sizeof().
+ */
+#define USBCHIEF_DEVICE_INFO_VERSION	1
+
+typedef struct _USBCHIEF_PIPE_INFO {
+	BYTE EndpointAddress;
+	BYTE PipeType;		/* WDF_USB_PIPE_TYPE */
+	BYTE Interval;
+	BYTE Reserved;
+	DWORD MaximumPacketSize;
+	DWORD MaximumTransferSize;
+} USBCHIEF_PIPE_INFO, *PUSBCHIEF_PIPE_INFO;
+
+typedef struct _USBCHIEF_DEVICE_INFO {
+	DWORD Version;
+	DWORD Length;		/* size of the whole blob */
+	WORD FirmwareVersion;	/* bcdDevice, as IOCTL_GET_FIRMWARE_VERSION */
+	BYTE HighSpeed;
+	BYTE WaitWake;
+	BYTE AlternateSetting;
+	BYTE NumberOfPipes;
+	WORD Reserved;
+	DWORD MaximumTransferSize;	/* largest stage size over all pipes */
+	DWORD DeviceDescriptorOffset;
+	DWORD DeviceDescriptorLength;
+	DWORD ConfigurationDescriptorOffset;
+	DWORD ConfigurationDescriptorLength;
+	DWORD PipesOffset;
+	DWORD PipeInfoLength;
+} USBCHIEF_DEVICE_INFO, *PUSBCHIEF_DEVICE_INFO;
+
+#define READ_AHEAD_DEFAULT_SIZE		(4 * 1024 * 1024)
+#define READ_AHEAD_MAX_SIZE		(64 * 1024 * 1024)
+/* rings and stage buffers of all handles of a device, non-paged */
+#define READ_AHEAD_DEVICE_BUDGET	(128 * 1024 * 1024)
+#define READ_AHEAD_DEFAULT_DEPTH	2
+#define READ_AHEAD_MAX_DEPTH		8
+#define READ_AHEAD_MAX_STAGES		32
+
+typedef struct _READ_AHEAD_STAGE {
+	struct _READ_AHEAD *ReadAhead;
+	WDFREQUEST Request;
+	WDFMEMORY Memory;
+	PUCHAR Buffer;
+	PPIPE_CONTEXT PipeContext;
+	ULONG Size;		/* stage size in whole packets of this pipe */
+	ULONG Length;
+	BOOLEAN Posted;
+	BOOLEAN Sent;		/* handed to the pipe, under Lock; only these are cancelled */
+	ULONGLONG PostTime;
+} READ_AHEAD_STAGE, *PREAD_AHEAD_STAGE;
+
+#define AUTOTUNE_DEFAULT_MIN_STAGE	4096
+#define AUTOTUNE_DEFAULT_INTERVAL	250
+#define AUTOTUNE_MIN_INTERVAL		50
+#define AUTOTUNE_DEFAULT_LATENCY	10000
+#define AUTOTUNE_HOLD_INTERVALS		8
+
+typedef struct _AUTOTUNE {
+	WDFWAITLOCK SetLock;		/* one IOCTL_SET_AUTOTUNE at a time */
+	WDFTIMER Timer;
+	BOOLEAN Enabled;
+	USBCHIEF_AUTOTUNE_PARAMS Params;
+	ULONGLONG Frequency;
+	/* the current interval, fed by the completion routine */
+	ULONGLONG WindowStart;
+	ULONGLONG WindowBytes;
+	ULONGLONG WindowLatency;
+	ULONG WindowStages;
+	ULONG WindowShort;
+	/* a change on trial and how to undo it */
+	ULONG Trial;
+	ULONGLONG Baseline;
+	ULONG UndoStageSize;
+	ULONG UndoDepth;
+	ULONG Hold;
+	USBCHIEF_AUTOTUNE_STATE State;
+} AUTOTUNE, *PAUTOTUNE;
+
+/* rules compiled to the set that applies to every endpoint slot */
+typedef struct _FILTER {
+	ULONG Count;
+	ULONG SlotRules[32];	/* rule bits by USBCHIEF_ENDPOINT_SLOT */
+	USBCHIEF_FILTER_RULE Rules[FILTER_MAX_RULES];
+	USBCHIEF_FILTER_STATS Stats;
+} FILTER, *PFILTER;
+
+/*
+ * Driver-side read-ahead of one handle. Completed stages are stored in
+ * Ring as frames; Tail is the oldest byte, FrameConsumed the part of the
+ * oldest frame's payload already handed out by a raw read.
+ */
+typedef struct _READ_AHEAD {
+	PDEVICE_CONTEXT DeviceContext;
+	ULONG PipeMask;		/* capture only, 0 for the handle's own pipe */
+	ULONG Budget;		/* bytes charged to the device, given back by Destroy */
+	WDFSPINLOCK Lock;
+	WDFQUEUE PendingReads;
+	PUCHAR Ring;
+	ULONG Size;
+	ULONG Tail;
+	ULONG Used;
+	ULONG FrameConsumed;
+	ULONG StageSize;		/* largest stage */
+	ULONG RequestedStageSize;	/* before rounding to the packet size */
+	ULONG Depth;
+	ULONG ActiveDepth;		/* stages per pipe kept posted, <= Depth */
+	ULONG StageCount;
+	ULONG Posted;
+	BOOLEAN Stopping;
+	BOOLEAN Detached;		/* lost its pipes in a setting switch */
+	KEVENT Idle;
+	ULONG Policy;
+	BOOLEAN GapPending;
+	USBCHIEF_GAP_RECORD Gap;
+	ULONGLONG BlockedSince;
+	ULONGLONG BlockedTime;
+	ULONG Gaps;
+	ULONG HighWater;
+	ULONG Overflows;
+	ULONGLONG OverflowBytes;
+	ULONGLONG Frames;
+	ULONGLONG Bytes;
+	/* pipes by index in the middle of a transfer that is kept or dropped */
+	ULONG OpenTransfers;
+	ULONG DroppedTransfers;
+	FILTER Filter;
+	AUTOTUNE Autotune;
+	READ_AHEAD_STAGE Stages[READ_AHEAD_MAX_STAGES];
+} READ_AHEAD, *PREAD_AHEAD;
+
+/* the pipe counters at the end of every interval, Windows + 1 of them */
+typedef struct _ANALYTICS_SAMPLE {
+	ULONGLONG Time;
+	PIPE_STATS Pipes[USBCHIEF_MAX_PIPES];
+} ANALYTICS_SAMPLE, *PANALYTICS_SAMPLE;
+
+/* context of the analytics timer */
+typedef struct _ANALYTICS {
+	WDFTIMER Timer;
+	ULONG Windows;
+	ULONG Next;			/* sample written next */
+	ULONG Filled;
+	USBCHIEF_ANALYTICS Snapshot;	/* under AnalyticsLock */
+	ANALYTICS_SAMPLE Samples[ANALYTICS_MAX_WINDOWS + 1];
+} ANALYTICS, *PANALYTICS;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ANALYTICS, GetAnalytics)
+
+typedef struct _SESSION {
+	ULONG Token;			/* 0 for a free slot */
+	BOOLEAN Attached;		/* a handle has it */
+	ULONGLONG RemovedTime;		/* performance counter, 0 while present */
+	/* what the handle was opened on, a resume must match it */
+	USB_DEVICE_DESCRIPTOR Device;
+	BOOLEAN PipeHandle;
+	UCHAR PipeIndex;
+	UCHAR EndpointAddress;
+	UCHAR AlternateSetting;
+	ULONG ReadMode;
+	ULONG ReadTimeout;
+	BOOLEAN ReadAhead;
+	ULONG PipeMask;
+	USBCHIEF_READ_AHEAD_PARAMS ReadAheadParams;
+	ULONG Policy;
+	USBCHIEF_AUTOTUNE_PARAMS Autotune;
+} SESSION, *PSESSION;
 #endif